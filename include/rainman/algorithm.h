@@ -0,0 +1,426 @@
+#ifndef RAINMAN_ALGORITHM_H
+#define RAINMAN_ALGORITHM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "types.h"
+
+/*
+ * Algorithms over virtual arrays that work a chunk at a time, so that arrays larger than memory can be
+ * processed with bounded memory and large sequential page I/O.
+ */
+
+namespace rainman {
+    struct parallel_options {
+        // Worker threads. 0 uses one per core.
+        uint64_t threads = 0;
+
+        // Cache pages per chunk. A chunk is the unit of work: one worker reads it, processes it as one contiguous
+        // span and writes it back.
+        uint64_t chunk_pages = 16;
+    };
+
+    struct sort_options {
+        // Bytes of element buffers, drawn from allocator. Runs of this size are sorted in memory and merged
+        // with one buffer per run.
+        uint64_t memory_budget = 0x4000000;
+
+        // Threads that sort runs at the same time. The budget is split between them. 0 uses one per core.
+        uint64_t threads = 1;
+
+        // Cache that sorted runs are spilled to, e.g. on a different disk. Defaults to the array's cache.
+        cache scratch{};
+
+        Allocator allocator{};
+    };
+
+    namespace detail {
+        // Smallest buffer per run in a merge. Merges with more runs than fit in the budget take several passes.
+        constexpr uint64_t min_merge_buffer = 0x10000;
+
+        // An element buffer from an Allocator, freed when it goes out of scope.
+        template<typename Type>
+        class sort_buffer {
+        private:
+            Allocator _allocator;
+            Type *_data;
+            uint64_t _n;
+
+        public:
+            sort_buffer(const Allocator &allocator, uint64_t n)
+                    : _allocator(allocator), _data(_allocator.rmalloc<Type>(n)), _n(n) {}
+
+            sort_buffer(const sort_buffer &) = delete;
+
+            sort_buffer &operator=(const sort_buffer &) = delete;
+
+            Type *data() const {
+                return _data;
+            }
+
+            [[nodiscard]] uint64_t size() const {
+                return _n;
+            }
+
+            ~sort_buffer() {
+                _allocator.rfree(_data);
+            }
+        };
+
+        inline uint64_t worker_count(uint64_t threads) {
+            return threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // Split the elements of arr into chunks that start at page boundaries and let workers take them in turn.
+        // body(begin, end, worker) processes elements [begin, end). Chunks never share a page except for an element
+        // that straddles a page boundary, so workers hardly ever contend for a frame.
+        template<typename Type, typename Body>
+        void for_each_chunk(virtual_array<Type> &arr, const parallel_options &options, Body body) {
+            auto n = arr.size();
+            if (n == 0) {
+                return;
+            }
+
+            auto chunk_bytes = arr.parent().page_size() * std::max<uint64_t>(options.chunk_pages, 1);
+            auto base = arr.index();
+
+            // Element that a chunk starting near the byte at index begins with.
+            auto element_at = [&](uint64_t index) {
+                return std::min(n, (index - base + sizeof(Type) - 1) / sizeof(Type));
+            };
+
+            auto first_boundary = (base / chunk_bytes + 1) * chunk_bytes;
+            auto end_index = base + n * sizeof(Type);
+            auto n_chunks = end_index <= first_boundary
+                            ? 1 : 1 + (end_index - first_boundary + chunk_bytes - 1) / chunk_bytes;
+            auto n_workers = std::min(worker_count(options.threads), n_chunks);
+
+            std::atomic<uint64_t> next_chunk{};
+            std::vector<std::exception_ptr> errors(n_workers);
+            auto work = [&](uint64_t worker) {
+                try {
+                    for (auto c = next_chunk++; c < n_chunks; c = next_chunk++) {
+                        auto begin = c == 0 ? 0 : element_at(first_boundary + (c - 1) * chunk_bytes);
+                        auto end = element_at(first_boundary + c * chunk_bytes);
+                        if (begin < end) {
+                            body(begin, end, worker);
+                        }
+                    }
+                } catch (...) {
+                    errors[worker] = std::current_exception();
+                    next_chunk = n_chunks;
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (uint64_t w = 1; w < n_workers; w++) {
+                workers.emplace_back(work, w);
+            }
+            work(0);
+
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            for (auto &error : errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        }
+
+        struct sort_run {
+            uint64_t begin;
+            uint64_t end;
+        };
+
+        // Merge runs of src into dest at the same positions, with a buffer of buffer_size elements per run
+        // and for the output.
+        template<typename Type, typename Compare>
+        void merge_runs(virtual_array<Type> &src, virtual_array<Type> &dest, const std::vector<sort_run> &runs,
+                        uint64_t buffer_size, Compare &comp, const Allocator &allocator) {
+            struct cursor {
+                uint64_t next{};
+                uint64_t end{};
+                uint64_t pos{};
+                uint64_t count{};
+            };
+
+            sort_buffer<Type> buffers(allocator, buffer_size * (runs.size() + 1));
+            auto *out = buffers.data() + buffer_size * runs.size();
+            uint64_t n_out = 0;
+            uint64_t out_index = runs.front().begin;
+
+            std::vector<cursor> cursors;
+            auto refill = [&](uint64_t r) {
+                auto &c = cursors[r];
+                c.count = std::min(buffer_size, c.end - c.next);
+                c.pos = 0;
+                src.get_range(buffers.data() + r * buffer_size, c.next, c.count);
+                c.next += c.count;
+            };
+
+            // A heap of run numbers, ordered by each run's current element.
+            std::vector<uint64_t> heap;
+            auto head = [&](uint64_t r) -> const Type & {
+                return buffers.data()[r * buffer_size + cursors[r].pos];
+            };
+            auto after = [&](uint64_t a, uint64_t b) {
+                return comp(head(b), head(a));
+            };
+
+            for (uint64_t r = 0; r < runs.size(); r++) {
+                cursors.push_back(cursor{.next=runs[r].begin, .end=runs[r].end});
+                refill(r);
+                if (cursors[r].count > 0) {
+                    heap.push_back(r);
+                }
+            }
+            std::make_heap(heap.begin(), heap.end(), after);
+
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), after);
+                auto r = heap.back();
+
+                out[n_out++] = head(r);
+                if (n_out == buffer_size) {
+                    dest.set_range(out, out_index, n_out);
+                    out_index += n_out;
+                    n_out = 0;
+                }
+
+                auto &c = cursors[r];
+                if (++c.pos == c.count) {
+                    refill(r);
+                }
+
+                if (c.pos < c.count) {
+                    std::push_heap(heap.begin(), heap.end(), after);
+                } else {
+                    heap.pop_back();
+                }
+            }
+
+            dest.set_range(out, out_index, n_out);
+        }
+    }
+
+    // Call fn(element) for every element of arr on several threads, a page-aligned chunk at a time. Chunks that
+    // fn changes are written back.
+    template<typename Type, typename Function>
+    void parallel_for_each(virtual_array<Type> &arr, Function fn, const parallel_options &options = {}) {
+        static_assert(std::is_trivially_copyable_v<Type>, "parallel_for_each needs trivially copyable elements");
+
+        std::vector<std::vector<Type>> spans(detail::worker_count(options.threads));
+        std::vector<std::vector<Type>> originals(spans.size());
+
+        detail::for_each_chunk(arr, options, [&](uint64_t begin, uint64_t end, uint64_t worker) {
+            auto &span = spans[worker];
+            auto &original = originals[worker];
+            span.resize(end - begin);
+            arr.get_range(span.data(), begin, span.size());
+            original = span;
+
+            for (auto &element : span) {
+                fn(element);
+            }
+
+            // Unchanged chunks are not written, so that their pages do not become dirty.
+            if (std::memcmp(span.data(), original.data(), span.size() * sizeof(Type)) != 0) {
+                arr.set_range(span.data(), begin, span.size());
+            }
+        });
+    }
+
+    // Set dest[i] = fn(src[i]) for every element of src on several threads, a page-aligned chunk of src at a time.
+    // dest must be at least as long as src, and may be src itself.
+    template<typename Type, typename Result, typename Function>
+    void parallel_transform(virtual_array<Type> &src, virtual_array<Result> &dest, Function fn,
+                            const parallel_options &options = {}) {
+        static_assert(std::is_trivially_copyable_v<Type> && std::is_trivially_copyable_v<Result>,
+                      "parallel_transform needs trivially copyable elements");
+
+        if (dest.size() < src.size()) {
+            throw MemoryErrors::SegmentationFaultException();
+        }
+
+        std::vector<std::vector<Type>> inputs(detail::worker_count(options.threads));
+        std::vector<std::vector<Result>> outputs(inputs.size());
+
+        detail::for_each_chunk(src, options, [&](uint64_t begin, uint64_t end, uint64_t worker) {
+            auto &input = inputs[worker];
+            auto &output = outputs[worker];
+            input.resize(end - begin);
+            output.resize(end - begin);
+
+            src.get_range(input.data(), begin, input.size());
+            std::transform(input.begin(), input.end(), output.begin(), fn);
+            dest.set_range(output.data(), begin, output.size());
+        });
+    }
+
+    // Combine every element of arr with op on several threads. Each chunk is folded from init on its own and the
+    // results are combined in order, so init has to be an identity of op, such as 0 for a sum, and op has to be
+    // associative but need not be commutative. As for std::reduce, op takes a Value and an element as well as two
+    // Values.
+    template<typename Type, typename Value, typename Operation = std::plus<>>
+    Value parallel_reduce(virtual_array<Type> &arr, Value init, Operation op = Operation(),
+                          const parallel_options &options = {}) {
+        static_assert(std::is_trivially_copyable_v<Type>, "parallel_reduce needs trivially copyable elements");
+        static_assert(std::is_invocable_r_v<Value, Operation &, Value, const Type &> &&
+                      std::is_invocable_r_v<Value, Operation &, Value, Value>,
+                      "parallel_reduce combines a Value with an element and two Values into a Value");
+
+        struct partial {
+            uint64_t begin;
+            Value value;
+        };
+
+        std::vector<std::vector<Type>> spans(detail::worker_count(options.threads));
+        std::vector<std::vector<partial>> partials(spans.size());
+
+        detail::for_each_chunk(arr, options, [&](uint64_t begin, uint64_t end, uint64_t worker) {
+            auto &span = spans[worker];
+            span.resize(end - begin);
+            arr.get_range(span.data(), begin, span.size());
+
+            Value value = init;
+            for (auto &element : span) {
+                value = op(value, element);
+            }
+
+            partials[worker].push_back(partial{.begin=begin, .value=value});
+        });
+
+        std::vector<partial> ordered;
+        for (auto &worker_partials : partials) {
+            ordered.insert(ordered.end(), worker_partials.begin(), worker_partials.end());
+        }
+        std::sort(ordered.begin(), ordered.end(), [](auto &a, auto &b) { return a.begin < b.begin; });
+
+        Value result = init;
+        for (auto &p : ordered) {
+            result = op(result, p.value);
+        }
+
+        return result;
+    }
+
+    // Sort arr with comp, which orders elements like std::sort's. Runs that fit in the memory budget are sorted by
+    // several threads and spilled to a scratch array in options.scratch, then merged k-way into arr, reading and
+    // writing a large buffer at a time. Memory beyond the budget is only used for bookkeeping.
+    template<typename Type, typename Compare = std::less<Type>>
+    void external_sort(virtual_array<Type> &arr, Compare comp = Compare(), const sort_options &options = {}) {
+        static_assert(std::is_trivially_copyable_v<Type>, "external_sort needs trivially copyable elements");
+
+        auto n = arr.size();
+        if (n < 2) {
+            return;
+        }
+
+        auto n_threads = detail::worker_count(options.threads);
+        auto budget = std::max<uint64_t>(options.memory_budget / sizeof(Type), 2);
+
+        // Data that fits in the budget is sorted in place.
+        if (n <= budget) {
+            detail::sort_buffer<Type> buffer(options.allocator, n);
+            arr.get_range(buffer.data(), 0, n);
+            std::sort(buffer.data(), buffer.data() + n, comp);
+            arr.set_range(buffer.data(), 0, n);
+            return;
+        }
+
+        auto scratch = virtual_array<Type>(options.scratch.valid() ? options.scratch : arr.parent(), n);
+
+        // Run generation: every thread sorts one run at a time in its share of the budget.
+        n_threads = std::min(n_threads, (n + budget - 1) / budget);
+        auto run_size = std::max<uint64_t>(budget / n_threads, 1);
+        auto n_runs = (n + run_size - 1) / run_size;
+
+        std::atomic<uint64_t> next_run{};
+        std::vector<std::exception_ptr> errors(n_threads);
+        auto sort_runs = [&](uint64_t t) {
+            try {
+                detail::sort_buffer<Type> buffer(options.allocator, run_size);
+                for (auto r = next_run++; r < n_runs; r = next_run++) {
+                    auto begin = r * run_size;
+                    auto count = std::min(run_size, n - begin);
+                    arr.get_range(buffer.data(), begin, count);
+                    std::sort(buffer.data(), buffer.data() + count, comp);
+                    scratch.set_range(buffer.data(), begin, count);
+                }
+            } catch (...) {
+                errors[t] = std::current_exception();
+                next_run = n_runs;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (uint64_t t = 1; t < n_threads; t++) {
+            workers.emplace_back(sort_runs, t);
+        }
+        sort_runs(0);
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        for (auto &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        std::vector<detail::sort_run> runs;
+        for (uint64_t begin = 0; begin < n; begin += run_size) {
+            runs.push_back(detail::sort_run{.begin=begin, .end=std::min(begin + run_size, n)});
+        }
+
+        // Merge passes alternate between the scratch array and arr, with as many runs per merge as the budget
+        // allows buffers of at least min_merge_buffer bytes for.
+        auto min_buffer = std::max<uint64_t>(detail::min_merge_buffer / sizeof(Type), 1);
+        auto fan_in = std::max<uint64_t>(budget / min_buffer, 3) - 1;
+
+        auto *src = &scratch;
+        auto *dest = &arr;
+
+        while (true) {
+            std::vector<detail::sort_run> merged;
+
+            for (uint64_t first = 0; first < runs.size(); first += fan_in) {
+                auto last = std::min<uint64_t>(first + fan_in, runs.size());
+                std::vector<detail::sort_run> group(runs.begin() + first, runs.begin() + last);
+
+                auto buffer_size = std::max<uint64_t>(budget / (group.size() + 1), 1);
+                detail::merge_runs(*src, *dest, group, buffer_size, comp, options.allocator);
+                merged.push_back(detail::sort_run{.begin=group.front().begin, .end=group.back().end});
+            }
+
+            runs = merged;
+            std::swap(src, dest);
+
+            if (runs.size() == 1) {
+                break;
+            }
+        }
+
+        // After an even number of passes the result is in the scratch array.
+        if (src != &arr) {
+            auto chunk = std::min(budget, n);
+            detail::sort_buffer<Type> buffer(options.allocator, chunk);
+            for (uint64_t i = 0; i < n; i += chunk) {
+                auto count = std::min(chunk, n - i);
+                scratch.get_range(buffer.data(), i, count);
+                arr.set_range(buffer.data(), i, count);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef RAINMAN_ARENA_H
+#define RAINMAN_ARENA_H
+
+#include <cstdint>
+#include <vector>
+#include "cache.h"
+
+namespace rainman {
+    /*
+     * page_arena hands out page-aligned pages of a cache to containers whose nodes are pages. Pages are allocated
+     * from the cache a segment at a time, with one page to spare for alignment, and have no handle, so compaction
+     * never moves them. Released pages are reused. The arena's pages are deallocated with it.
+     */
+    class page_arena {
+    private:
+        cache _cache;
+        uint64_t _page{};
+        uint64_t _segment_pages{};
+        uint64_t _used{};
+        std::vector<uint64_t> _allocations{};
+        std::vector<uint64_t> _spare{};
+
+    public:
+        explicit page_arena(const cache &cache, uint64_t segment_pages = 64);
+
+        page_arena(const page_arena &) = delete;
+
+        page_arena &operator=(const page_arena &) = delete;
+
+        // Returns the byte-index of an unused page. Its contents are undefined.
+        uint64_t allocate();
+
+        // Give a page back for reuse.
+        void release(uint64_t index);
+
+        // Returns the number of pages in use.
+        [[nodiscard]] uint64_t pages() const {
+            return _used;
+        }
+
+        [[nodiscard]] uint64_t page_size() const {
+            return _page;
+        }
+
+        ~page_arena();
+    };
+}
+
+#endif
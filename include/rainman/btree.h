@@ -0,0 +1,570 @@
+#ifndef RAINMAN_BTREE_H
+#define RAINMAN_BTREE_H
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "arena.h"
+#include "types.h"
+
+namespace rainman {
+    /*
+     * virtual_btree is a B+tree whose nodes are pages of a cache, for ordered lookups and range scans over more
+     * entries than fit in memory. Nodes are read in place through pins. A node keeps its keys contiguously, apart
+     * from its values or children, and is searched with a branch-free binary search over them.
+     *
+     * Leaves are linked in key order, so iterators walk them a page at a time, keeping the current leaf pinned.
+     * bulk_load() builds the tree bottom-up from sorted arrays, with its leaves in address order, so that scans
+     * read the cache file sequentially.
+     *
+     * Keys are unique and compared with operator<. Keys and values are stored byte for byte, so they must be
+     * trivially copyable. A virtual_btree is not persistent and not thread-safe. A split pins two nodes at once,
+     * so the cache needs at least two frames.
+     */
+    template<typename Key, typename Value>
+    class virtual_btree {
+    private:
+        static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                      "virtual_btree stores keys and values byte for byte");
+
+        static constexpr uint64_t npos = UINT64_MAX;
+        static constexpr uint64_t min_frames = 2;
+
+        struct node_header {
+            uint32_t leaf;
+            uint32_t count;
+            uint64_t next;
+        };
+
+        cache _cache;
+        page_arena _arena;
+        std::shared_ptr<cache_counters> _counters{};
+
+        // Layout of a node: the header, then the keys, then the values (leaves) or child pages (inner nodes).
+        uint64_t _page{};
+        uint64_t _leaf_capacity{};
+        uint64_t _inner_capacity{};
+        uint64_t _values_offset{};
+        uint64_t _children_offset{};
+
+        uint64_t _root{npos};
+        uint64_t _first_leaf{npos};
+        uint64_t _height{};
+        uint64_t _n{};
+
+        static uint64_t align(uint64_t offset, uint64_t alignment) {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        template<typename Byte>
+        static auto header(Byte *data) {
+            using type = std::conditional_t<std::is_const_v<Byte>, const node_header, node_header>;
+            return reinterpret_cast<type *>(data);
+        }
+
+        template<typename Byte>
+        static auto keys(Byte *data) {
+            using type = std::conditional_t<std::is_const_v<Byte>, const Key, Key>;
+            return reinterpret_cast<type *>(data + sizeof(node_header));
+        }
+
+        template<typename Byte>
+        auto values(Byte *data) const {
+            using type = std::conditional_t<std::is_const_v<Byte>, const Value, Value>;
+            return reinterpret_cast<type *>(data + _values_offset);
+        }
+
+        template<typename Byte>
+        auto children(Byte *data) const {
+            using type = std::conditional_t<std::is_const_v<Byte>, const uint64_t, uint64_t>;
+            return reinterpret_cast<type *>(data + _children_offset);
+        }
+
+        pinned_view<const uint8_t> read(uint64_t index) {
+            return pinned_view<const uint8_t>(_cache, index, _page, _counters.get());
+        }
+
+        pinned_view<uint8_t> write(uint64_t index) {
+            return pinned_view<uint8_t>(_cache, index, _page, _counters.get());
+        }
+
+        // Returns the first of keys[0, n) that is not less than key, or with Upper, greater than key. The loop
+        // runs log2(n) times whatever the keys, and compiles to conditional moves instead of branches.
+        template<bool Upper>
+        static uint64_t search(const Key *keys, uint64_t n, const Key &key) {
+            if (n == 0) {
+                return 0;
+            }
+
+            const Key *base = keys;
+            while (n > 1) {
+                auto half = n / 2;
+                base = (Upper ? !(key < base[half]) : base[half] < key) ? base + half : base;
+                n -= half;
+            }
+
+            return (base - keys) + (Upper ? !(key < *base) : *base < key);
+        }
+
+        // Descend to the leaf that holds key, recording the inner nodes passed and the child taken in each.
+        uint64_t descend(const Key &key, std::vector<std::pair<uint64_t, uint64_t>> *path) {
+            auto index = _root;
+
+            for (uint64_t level = 1; level < _height; level++) {
+                auto page = read(index);
+                auto *data = page.span().data();
+                auto slot = search<true>(keys(data), header(data)->count, key);
+                if (path != nullptr) {
+                    path->emplace_back(index, slot);
+                }
+
+                index = children(data)[slot];
+            }
+
+            return index;
+        }
+
+        uint64_t new_node(bool leaf) {
+            auto index = _arena.allocate();
+            node_header empty{.leaf=leaf, .count=0, .next=npos};
+            _cache.write(empty, index, _counters.get());
+            return index;
+        }
+
+        // Insert separator and the page right of it into the parent at the end of path, splitting it and the
+        // nodes above it as long as they are full.
+        void insert_into_parent(std::vector<std::pair<uint64_t, uint64_t>> &path, Key separator, uint64_t right) {
+            while (!path.empty()) {
+                auto [index, slot] = path.back();
+                path.pop_back();
+
+                auto page = write(index);
+                auto *data = page.span().data();
+                auto *head = header(data);
+                auto *node_keys = keys(data);
+                auto *node_children = children(data);
+                uint64_t count = head->count;
+
+                if (count < _inner_capacity) {
+                    std::memmove(node_keys + slot + 1, node_keys + slot, (count - slot) * sizeof(Key));
+                    std::memmove(node_children + slot + 2, node_children + slot + 1, (count - slot) * sizeof(uint64_t));
+                    node_keys[slot] = separator;
+                    node_children[slot + 1] = right;
+                    head->count++;
+                    return;
+                }
+
+                std::vector<Key> merged_keys(node_keys, node_keys + count);
+                std::vector<uint64_t> merged_children(node_children, node_children + count + 1);
+                merged_keys.insert(merged_keys.begin() + (int64_t) slot, separator);
+                merged_children.insert(merged_children.begin() + (int64_t) slot + 1, right);
+
+                // The middle key moves up; the keys and children on either side of it stay in two nodes.
+                auto mid = (count + 1) / 2;
+                auto sibling = new_node(false);
+                auto sibling_page = write(sibling);
+                auto *sibling_data = sibling_page.span().data();
+
+                std::memcpy(node_keys, merged_keys.data(), mid * sizeof(Key));
+                std::memcpy(node_children, merged_children.data(), (mid + 1) * sizeof(uint64_t));
+                head->count = mid;
+
+                header(sibling_data)->count = count - mid;
+                std::memcpy(keys(sibling_data), merged_keys.data() + mid + 1, (count - mid) * sizeof(Key));
+                std::memcpy(children(sibling_data), merged_children.data() + mid + 1,
+                            (count - mid + 1) * sizeof(uint64_t));
+
+                separator = merged_keys[mid];
+                right = sibling;
+            }
+
+            auto root = new_node(false);
+            auto page = write(root);
+            auto *data = page.span().data();
+            header(data)->count = 1;
+            keys(data)[0] = separator;
+            children(data)[0] = _root;
+            children(data)[1] = right;
+
+            _root = root;
+            _height++;
+        }
+
+        bool insert(const Key &key, const Value &value, bool assign) {
+            if (_root == npos) {
+                _root = _first_leaf = new_node(true);
+                _height = 1;
+            }
+
+            std::vector<std::pair<uint64_t, uint64_t>> path;
+            auto leaf = descend(key, &path);
+
+            uint64_t pos;
+            {
+                auto page = read(leaf);
+                auto *data = page.span().data();
+                auto count = header(data)->count;
+                pos = search<false>(keys(data), count, key);
+
+                if (pos < count && !(key < keys(data)[pos])) {
+                    if (assign) {
+                        _cache.write(value, leaf + _values_offset + pos * sizeof(Value), _counters.get());
+                    }
+
+                    return false;
+                }
+            }
+
+            auto page = write(leaf);
+            auto *data = page.span().data();
+            auto *head = header(data);
+            auto *leaf_keys = keys(data);
+            auto *leaf_values = values(data);
+            uint64_t count = head->count;
+
+            if (count < _leaf_capacity) {
+                std::memmove(leaf_keys + pos + 1, leaf_keys + pos, (count - pos) * sizeof(Key));
+                std::memmove(leaf_values + pos + 1, leaf_values + pos, (count - pos) * sizeof(Value));
+                leaf_keys[pos] = key;
+                leaf_values[pos] = value;
+                head->count++;
+                _n++;
+                return true;
+            }
+
+            std::vector<Key> merged_keys(leaf_keys, leaf_keys + count);
+            std::vector<Value> merged_values(leaf_values, leaf_values + count);
+            merged_keys.insert(merged_keys.begin() + (int64_t) pos, key);
+            merged_values.insert(merged_values.begin() + (int64_t) pos, value);
+
+            auto left_n = (count + 1) / 2;
+            auto right_n = count + 1 - left_n;
+            auto sibling = new_node(true);
+            {
+                auto sibling_page = write(sibling);
+                auto *sibling_data = sibling_page.span().data();
+                header(sibling_data)->count = right_n;
+                header(sibling_data)->next = head->next;
+                std::memcpy(keys(sibling_data), merged_keys.data() + left_n, right_n * sizeof(Key));
+                std::memcpy(values(sibling_data), merged_values.data() + left_n, right_n * sizeof(Value));
+            }
+
+            std::memcpy(leaf_keys, merged_keys.data(), left_n * sizeof(Key));
+            std::memcpy(leaf_values, merged_values.data(), left_n * sizeof(Value));
+            head->count = left_n;
+            head->next = sibling;
+            page.release();
+
+            insert_into_parent(path, merged_keys[left_n], sibling);
+            _n++;
+            return true;
+        }
+
+        // Split n entries into as few groups of at most per_group as possible, evenly.
+        static std::vector<uint64_t> group_sizes(uint64_t n, uint64_t per_group) {
+            auto groups = (n + per_group - 1) / per_group;
+            std::vector<uint64_t> sizes(groups, n / groups);
+            for (uint64_t i = 0; i < n % groups; i++) {
+                sizes[i]++;
+            }
+
+            return sizes;
+        }
+
+    public:
+        /*
+         * iterator walks the entries in key order, following the leaf links. It keeps its leaf pinned; copies
+         * share the pin.
+         */
+        class iterator {
+        private:
+            virtual_btree *_tree{};
+            uint64_t _leaf{npos};
+            uint64_t _slot{};
+            std::shared_ptr<pinned_view<const uint8_t>> _page{};
+
+            [[nodiscard]] const uint8_t *data() const {
+                return _page->span().data();
+            }
+
+            // Move to the next leaf while the slot is past the current one's entries. The current leaf is unpinned
+            // first, so that a scan holds a single frame.
+            void settle() {
+                while (_leaf != npos && _slot >= header(data())->count) {
+                    _leaf = header(data())->next;
+                    _slot = 0;
+                    _page.reset();
+                    if (_leaf != npos) {
+                        _page = std::make_shared<pinned_view<const uint8_t>>(_tree->read(_leaf));
+                    }
+                }
+            }
+
+            friend class virtual_btree;
+
+            iterator(virtual_btree *tree, uint64_t leaf, uint64_t slot) : _tree(tree), _leaf(leaf), _slot(slot) {
+                if (_leaf != npos) {
+                    _page = std::make_shared<pinned_view<const uint8_t>>(_tree->read(_leaf));
+                    settle();
+                }
+            }
+
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::pair<Key, Value>;
+            using difference_type = int64_t;
+            using pointer = void;
+            using reference = value_type;
+
+            iterator() = default;
+
+            [[nodiscard]] Key key() const {
+                return keys(data())[_slot];
+            }
+
+            [[nodiscard]] Value value() const {
+                return _tree->values(data())[_slot];
+            }
+
+            value_type operator*() const {
+                return {key(), value()};
+            }
+
+            iterator &operator++() {
+                _slot++;
+                settle();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                auto copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            bool operator==(const iterator &rhs) const {
+                return _leaf == rhs._leaf && _slot == rhs._slot;
+            }
+        };
+
+        explicit virtual_btree(const cache &cache) : _cache(cache), _arena(cache) {
+            if (_cache.frames() < min_frames) {
+                throw MemoryErrors::InvalidOperationException("B+tree needs a cache with at least two frames");
+            }
+
+            _counters = _cache.attribute();
+            _page = _arena.page_size();
+
+            // Alignment padding before the values or children takes less than their alignment.
+            if (_page > sizeof(node_header) + alignof(Value)) {
+                _leaf_capacity = (_page - sizeof(node_header) - alignof(Value)) / (sizeof(Key) + sizeof(Value));
+            }
+
+            if (_page > sizeof(node_header) + 2 * sizeof(uint64_t)) {
+                _inner_capacity = (_page - sizeof(node_header) - 2 * sizeof(uint64_t)) /
+                                  (sizeof(Key) + sizeof(uint64_t));
+            }
+
+            if (_leaf_capacity < 2 || _inner_capacity < 3) {
+                throw MemoryErrors::InvalidOperationException("B+tree nodes do not fit in a page");
+            }
+
+            _values_offset = align(sizeof(node_header) + _leaf_capacity * sizeof(Key), alignof(Value));
+            _children_offset = align(sizeof(node_header) + _inner_capacity * sizeof(Key), alignof(uint64_t));
+        }
+
+        virtual_btree(const virtual_btree &) = delete;
+
+        virtual_btree &operator=(const virtual_btree &) = delete;
+
+        // Build the tree from keys, sorted in strictly ascending order, and their values. Nodes are filled to
+        // fill of their capacity, leaving room for inserts. The tree must be empty.
+        void bulk_load(virtual_array<Key> &keys_array, virtual_array<Value> &values_array, double fill = 1.0) {
+            if (_root != npos) {
+                throw MemoryErrors::InvalidOperationException("Only an empty B+tree can be bulk-loaded");
+            }
+
+            auto n = keys_array.size();
+            if (values_array.size() != n) {
+                throw MemoryErrors::InvalidOperationException("Keys and values differ in number");
+            }
+
+            if (n == 0) {
+                return;
+            }
+
+            auto per_leaf = std::clamp<uint64_t>((uint64_t) ((double) _leaf_capacity * fill), 1, _leaf_capacity);
+            auto per_inner = std::clamp<uint64_t>((uint64_t) ((double) (_inner_capacity + 1) * fill), 3,
+                                                  _inner_capacity + 1);
+
+            // The first key and page of every node of the level being built.
+            std::vector<std::pair<Key, uint64_t>> level;
+            std::vector<uint64_t> allocated;
+            std::vector<Key> chunk_keys(per_leaf);
+            std::vector<Value> chunk_values(per_leaf);
+            Key last{};
+
+            try {
+                uint64_t begin = 0;
+                auto leaf = _arena.allocate();
+                allocated.push_back(leaf);
+
+                for (auto size : group_sizes(n, per_leaf)) {
+                    keys_array.get_range(chunk_keys.data(), begin, size);
+                    values_array.get_range(chunk_values.data(), begin, size);
+
+                    for (uint64_t i = 0; i < size; i++) {
+                        if ((begin + i > 0) && !(last < chunk_keys[i])) {
+                            throw MemoryErrors::InvalidOperationException("Keys are not in strictly ascending order");
+                        }
+
+                        last = chunk_keys[i];
+                    }
+
+                    begin += size;
+                    auto next = npos;
+                    if (begin < n) {
+                        next = _arena.allocate();
+                        allocated.push_back(next);
+                    }
+
+                    auto page = write(leaf);
+                    auto *data = page.span().data();
+                    *header(data) = node_header{.leaf=1, .count=(uint32_t) size, .next=next};
+                    std::memcpy(keys(data), chunk_keys.data(), size * sizeof(Key));
+                    std::memcpy(values(data), chunk_values.data(), size * sizeof(Value));
+
+                    level.emplace_back(chunk_keys[0], leaf);
+                    leaf = next;
+                }
+
+                _first_leaf = level[0].second;
+                _height = 1;
+
+                while (level.size() > 1) {
+                    std::vector<std::pair<Key, uint64_t>> parents;
+                    begin = 0;
+
+                    for (auto size : group_sizes(level.size(), per_inner)) {
+                        auto node = _arena.allocate();
+                        allocated.push_back(node);
+
+                        auto page = write(node);
+                        auto *data = page.span().data();
+                        *header(data) = node_header{.leaf=0, .count=(uint32_t) (size - 1), .next=npos};
+                        for (uint64_t i = 0; i < size; i++) {
+                            children(data)[i] = level[begin + i].second;
+                            if (i > 0) {
+                                keys(data)[i - 1] = level[begin + i].first;
+                            }
+                        }
+
+                        parents.emplace_back(level[begin].first, node);
+                        begin += size;
+                    }
+
+                    level = std::move(parents);
+                    _height++;
+                }
+            } catch (...) {
+                for (auto index : allocated) {
+                    _arena.release(index);
+                }
+
+                _first_leaf = npos;
+                _height = 0;
+                throw;
+            }
+
+            _root = level[0].second;
+            _n = n;
+        }
+
+        // Insert key with value unless the tree holds key already. Returns whether key was inserted.
+        bool insert(const Key &key, const Value &value) {
+            return insert(key, value, false);
+        }
+
+        // Insert key with value, or assign value to key if the tree holds it already. Returns whether key was
+        // inserted.
+        bool insert_or_assign(const Key &key, const Value &value) {
+            return insert(key, value, true);
+        }
+
+        // Returns the value of key, if the tree holds it.
+        std::optional<Value> find(const Key &key) {
+            if (_root == npos) {
+                return std::nullopt;
+            }
+
+            auto page = read(descend(key, nullptr));
+            auto *data = page.span().data();
+            auto count = header(data)->count;
+            auto pos = search<false>(keys(data), count, key);
+            if (pos < count && !(key < keys(data)[pos])) {
+                return values(data)[pos];
+            }
+
+            return std::nullopt;
+        }
+
+        bool contains(const Key &key) {
+            return find(key).has_value();
+        }
+
+        // Returns an iterator to the first entry whose key is not less than key.
+        iterator lower_bound(const Key &key) {
+            if (_root == npos) {
+                return end();
+            }
+
+            auto leaf = descend(key, nullptr);
+            uint64_t pos;
+            {
+                auto page = read(leaf);
+                auto *data = page.span().data();
+                pos = search<false>(keys(data), header(data)->count, key);
+            }
+
+            return iterator(this, leaf, pos);
+        }
+
+        iterator begin() {
+            return iterator(this, _first_leaf, 0);
+        }
+
+        iterator end() {
+            return iterator();
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _n;
+        }
+
+        // Returns the number of levels, 1 for a tree that is a single leaf.
+        [[nodiscard]] uint64_t height() const {
+            return _height;
+        }
+
+        // Returns the number of pages taken by the nodes.
+        [[nodiscard]] uint64_t pages() const {
+            return _arena.pages();
+        }
+
+        // Returns the accesses and page I/O of the tree since it was created or last reset.
+        [[nodiscard]] cache_stats stats() const {
+            return _counters->snapshot();
+        }
+
+        void reset_stats() {
+            _cache.reset_stats(_counters.get());
+        }
+    };
+}
+
+#endif
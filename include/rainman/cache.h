@@ -1,120 +1,433 @@
 #ifndef RAINMAN_CACHE_H
 #define RAINMAN_CACHE_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
+#include "errors.h"
+#include "freespace.h"
+#include "pool.h"
 #include "utils.h"
+#include "storage.h"
 
 namespace rainman {
+    enum class cache_backend {
+        // Page-buffered stdio file (default).
+        stdio,
+        // Memory-mapped page file, paged by the kernel.
+        mmap,
+        // Page-buffered file opened with O_DIRECT, bypassing the kernel page cache. The page size must be a
+        // multiple of the file system's block size.
+        direct
+    };
+
+    // A snapshot of cache_counters. The free space and residency fields are only filled in for a whole cache.
+    struct cache_stats {
+        uint64_t hits{};
+        uint64_t misses{};
+        uint64_t evictions{};
+        uint64_t write_backs{};
+        uint64_t prefetches{};
+        uint64_t bytes_read{};
+        uint64_t bytes_written{};
+        uint64_t io_wait_ns{};
+        uint64_t bytes_reclaimed{};
+
+        uint64_t resident_pages{};
+        uint64_t file_size{};
+        uint64_t free_bytes{};
+        uint64_t free_regions{};
+
+        [[nodiscard]] double hit_rate() const {
+            return hits + misses == 0 ? 1.0 : (double) hits / (double) (hits + misses);
+        }
+
+        // Share of the page file that is free but not at its end, i.e. lost to fragmentation.
+        [[nodiscard]] double fragmentation() const {
+            return file_size == 0 ? 0.0 : (double) free_bytes / (double) file_size;
+        }
+
+        // Add the counts of rhs, e.g. to total the stats of the arrays a structure is made of.
+        cache_stats &operator+=(const cache_stats &rhs) {
+            hits += rhs.hits;
+            misses += rhs.misses;
+            evictions += rhs.evictions;
+            write_backs += rhs.write_backs;
+            prefetches += rhs.prefetches;
+            bytes_read += rhs.bytes_read;
+            bytes_written += rhs.bytes_written;
+            io_wait_ns += rhs.io_wait_ns;
+            bytes_reclaimed += rhs.bytes_reclaimed;
+            resident_pages += rhs.resident_pages;
+            file_size += rhs.file_size;
+            free_bytes += rhs.free_bytes;
+            free_regions += rhs.free_regions;
+            return *this;
+        }
+    };
+
+    /*
+     * cache_counters count the page accesses and page I/O of a cache, or of the part of it used by one
+     * virtual_array. They are relaxed atomics, and every event is counted once, either for the virtual_array it was
+     * made for or for the cache itself, so bumping them is cheap. A snapshot taken while other threads use the
+     * cache is only approximately consistent.
+     *
+     * hits and misses count the page lookups of a page-buffered cache, one per page segment accessed, and
+     * evictions the resident pages replaced by misses. bytes_read and bytes_written count
+     * uncompressed page bytes moved to and from the page file, io_wait_ns the time spent waiting for it in the
+     * foreground, and prefetches the pages loaded by the background prefetcher. bytes_reclaimed counts the
+     * deallocated bytes whose disk space was given back to the file system.
+     */
+    struct cache_counters {
+        std::atomic<uint64_t> hits{};
+        std::atomic<uint64_t> misses{};
+        std::atomic<uint64_t> evictions{};
+        std::atomic<uint64_t> write_backs{};
+        std::atomic<uint64_t> prefetches{};
+        std::atomic<uint64_t> bytes_read{};
+        std::atomic<uint64_t> bytes_written{};
+        std::atomic<uint64_t> io_wait_ns{};
+        std::atomic<uint64_t> bytes_reclaimed{};
+
+        [[nodiscard]] cache_stats snapshot() const;
+
+        void reset();
+    };
+
+    // The part of a pinned byte range that lies in one page frame, or in one mapped extent (frame is nullptr).
+    struct page_segment {
+        uint8_t *data{};
+        uint64_t length{};
+        page_frame *frame{};
+        uint64_t begin{};
+    };
+
+    // The current byte-index of an allocation that compaction may move.
+    using cache_handle = std::shared_ptr<const std::atomic<uint64_t>>;
+
+    struct compaction_stats {
+        // Movable allocations considered, and their size.
+        uint64_t allocations{};
+        uint64_t bytes{};
+
+        uint64_t allocations_moved{};
+        uint64_t bytes_moved{};
+
+        // Deallocated bytes whose disk space was given back, and the page file's size before and after.
+        uint64_t bytes_reclaimed{};
+        uint64_t file_size_before{};
+        uint64_t file_size_after{};
+    };
+
+    struct cache_options {
+        cache_backend backend = cache_backend::stdio;
+
+        // Number of page buffers kept resident by a page-buffered cache.
+        uint64_t frames = 1;
+
+        // Byte budget for resident pages. When set, frames are allocated on demand from the cache's Allocator
+        // until the budget or the Allocator's peak size is reached, instead of up front. Data that fits stays
+        // in memory and only the coldest pages are spilled to the page file.
+        uint64_t memory_budget = 0;
+
+        // Number of pages to read ahead in the background once a sequential scan is detected.
+        // The cache keeps at least read_ahead + 1 frames.
+        uint64_t read_ahead = 0;
+
+        // Write dirty pages back in the background, oldest first and in runs of adjacent pages, once more than
+        // half of this share of the frames is dirty. Writers wait for the background writer while the whole share
+        // is dirty. 0 leaves dirty pages to eviction and flush().
+        double dirty_ratio = 0;
+
+        // Keep the page file across runs. The file starts with a header and the allocation catalog is
+        // saved on flush, so that a reopened cache can re-attach named allocations without rewriting data.
+        bool persistent = false;
+
+        // Compress every page with this codec, e.g. std::make_shared<rainman::lz_codec>(). Pages are kept at
+        // variable-length slots in the page file. Only stdio, non-persistent caches can be compressed.
+        std::shared_ptr<codec> compression{};
+
+        // More page files to stripe the pages across, round-robin with the cache's own file, so that page I/O
+        // is spread over several disks. Only stdio and direct caches can be striped, and not compressed. A
+        // persistent striped cache must be reopened with the same files in the same order.
+        std::vector<std::string> stripes{};
+
+        // Draw frames from a buffer_pool shared with other caches instead of allocating them per cache.
+        // frames and memory_budget are then ignored.
+        buffer_pool pool{};
+    };
+
     class cache : private ReferenceCounter {
     private:
-        class _icache {
+        class _icache : public pool_member {
         private:
-            struct cache_fragment {
-                uint64_t index;
-                uint64_t length;
-            };
+            static constexpr uint64_t npos = UINT64_MAX;
 
-            FILE *page_file{};
+            // Largest number of bytes written back by a single coalesced write.
+            static constexpr uint64_t max_write_run = 0x400000;
+
+            storage *_storage{};
             uint64_t page_size{};
-            uint64_t page_offset{};
-            uint8_t *page{};
-            uint64_t eof{};
+            uint64_t id{};
+
+            // Guards the allocator, the catalog and the prefetch queue.
             std::mutex mutex{};
 
-            std::vector<cache_fragment> fragments;
+            std::vector<page_frame *> frames;
+            std::unordered_map<uint64_t, page_frame *> page_table;
+            std::shared_mutex table_latch{};
+            std::condition_variable_any frame_cv;
+            std::atomic<uint64_t> frame_waiters{};
+            uint64_t max_frames{};
+            uint64_t clock_hand{};
+            buffer_pool pool{};
+
+            // Read-ahead state for sequential scans.
+            uint64_t read_ahead{};
+            std::atomic<uint64_t> last_page{npos};
+            uint64_t prefetch_end{};
+            std::deque<uint64_t> prefetch_queue;
+            // One background prefetcher per page transfer the storage can serve at a time.
+            std::vector<std::thread> prefetchers;
+            std::condition_variable prefetch_cv;
+            bool stopping{};
+
+            // Background write-back state. dirty_limit is 0 without a background writer.
+            std::atomic<uint64_t> n_dirty{};
+            std::atomic<uint64_t> dirty_clock{};
+            uint64_t dirty_limit{};
+            std::thread flusher;
+            std::condition_variable flush_cv;
+            std::condition_variable flushed_cv;
+
+            // Serializes write-backs, so that flush() does not return while the background writer still writes
+            // pages it has already marked clean.
+            std::mutex writing{};
+
+            free_space space;
             std::unordered_map<uint64_t, uint64_t> lenmap;
+            std::unordered_map<std::string, uint64_t> names;
+
+            // The length of the data in each named allocation, which can be less than the allocation so that the
+            // data grows in place. Saved in the catalog with the names.
+            std::unordered_map<std::string, uint64_t> name_lengths;
+            bool persistent{};
+
+            // Where the last saved catalog of a persistent cache is, which the header points to.
+            uint64_t catalog_begin{};
+            uint64_t catalog_end{};
+
+            // Handles of the allocations that compaction may move, by index. Guarded by the mutex.
+            std::unordered_map<uint64_t, std::shared_ptr<std::atomic<uint64_t>>> handles;
+
+            // Serializes compactions.
+            std::mutex compacting{};
             Allocator _allocator{};
 
-            uint8_t get_byte(uint64_t index);
+            // Counts of accesses made for no virtual_array, and of arrays that are gone.
+            cache_counters counters{};
 
-            void set_byte(uint8_t byte, uint64_t index);
+            // Counters handed out to virtual_arrays, which are added to the cache's totals. Guarded by the mutex.
+            std::vector<std::shared_ptr<cache_counters>> attributed;
+
+            // Write back the dirty byte-range of a frame, if any. Expects the frame to be latched or unreachable.
+            // The I/O is counted against owner, if set.
+            void write_back(page_frame &frame, cache_counters *owner = nullptr);
+
+            // Allocate a new frame, from the buffer pool if there is one, if the memory budget allows it.
+            // Expects the page table latch to be held exclusively.
+            page_frame *grow();
+
+            // Find a cold, unpinned frame with the clock sweep. Frames that are being loaded (and dirty frames,
+            // if clean_only is set) are never picked. Expects the page table latch to be held exclusively.
+            page_frame *sweep(bool clean_only);
+
+            // Pick an unpinned frame to load a page into: a new frame if one can be allocated, otherwise a cold one.
+            // Expects the page table latch to be held exclusively.
+            page_frame *find_victim(bool clean_only);
+
+            // Returns whether this thread holds every pin on the cache's frames through pin_range, so that waiting
+            // for a frame would never end. Expects the page table latch to be held exclusively.
+            bool pinned_by_caller();
+
+            // Mark an unpinned frame as busy so that it can be reused. Fails if the frame was pinned meanwhile.
+            // Expects the page table latch to be held exclusively.
+            static bool claim(page_frame *frame);
+
+            // Returns the frame holding the page at offset, pinned, loading it if it is not resident.
+            // Page I/O is done without holding the page table latch. Hits and misses are counted against owner, if set.
+            page_frame *pin(uint64_t offset, cache_counters *owner);
+
+            void unpin(page_frame *frame);
+
+            // Extend the dirty range of a frame to [begin, end). Expects the frame latch to be held.
+            void mark_dirty(page_frame &frame, uint64_t begin, uint64_t end);
+
+            // Load the page at offset into a clean frame, unless it is resident or no clean frame is free.
+            void load_ahead(uint64_t offset);
+
+            // Track sequential page accesses and queue read-ahead.
+            void detect_sequential(uint64_t offset);
+
+            // Queue pages [first, last) for the background prefetcher.
+            void queue_prefetch(uint64_t first, uint64_t last);
+
+            // Body of the background prefetcher.
+            void prefetch_loop();
+
+            // Write back the limit frames that have been dirty the longest, coalescing adjacent pages into single
+            // writes. Returns the number of frames written.
+            uint64_t write_dirty(uint64_t limit, bool foreground);
+
+            // Body of the background writer.
+            void flush_loop();
+
+            // Create the storage, frames and catalog of a new cache. A pooled cache joins its pool here.
+            void open_storage(FILE *fp, const cache_options &options);
+
+            // Leave the buffer pool and free the frames, writing back the valid ones, and the storage.
+            void release_frames();
+
+            // Wait a little for the background writer while too many frames are dirty.
+            void throttle();
+
+            // Empty allocations still take a byte of the page file, so that no two allocations share an index.
+            static uint64_t footprint(uint64_t length) {
+                return std::max<uint64_t>(length, 1);
+            }
+
+            // Reserve size bytes in the page file. Expects the cache mutex to be held.
+            uint64_t find_space(uint64_t size);
+
+            // Return the allocation at index to the free space. Expects the cache mutex to be held.
+            void release_space(uint64_t index);
+
+            // Return [index, index + length) to the free space and give the disk space of the whole pages it frees
+            // back to the file system. Returns the number of bytes given back. Expects the cache mutex to be held.
+            uint64_t free_range(uint64_t index, uint64_t length);
+
+            // Forget the resident pages [first, last) without writing them back. Pinned pages are kept.
+            void drop_pages(uint64_t first, uint64_t last);
+
+            // Copy length bytes from the byte-index from to to, a large chunk at a time. The ranges must not overlap.
+            void copy_range(uint64_t from, uint64_t to, uint64_t length);
+
+            // Point the handle and the name of the allocation at from to to. Expects the cache mutex to be held.
+            void rebind(uint64_t from, uint64_t to);
+
+            // Read the file header and allocation catalog of a persistent cache.
+            void load_catalog();
+
+            // Write the allocation catalog and the file header of a persistent cache.
+            void save_catalog();
 
         public:
             _icache() = default;
 
-            _icache(FILE *fp, uint64_t size, const Allocator &allocator = Allocator());
+            _icache(FILE *fp, uint64_t size, const cache_options &options, const Allocator &allocator = Allocator());
 
-            _icache(const std::string &filename, uint64_t size, const Allocator &allocator = Allocator());
+            _icache(const std::string &filename, uint64_t size, const cache_options &options,
+                    const Allocator &allocator = Allocator());
+
+            uint64_t allocate_bytes(uint64_t size);
 
             template<typename T>
             uint64_t allocate(uint64_t n) {
-                uint64_t size = n * sizeof(T);
-
-                mutex.lock();
-
-                bool found_fragment = false;
-                uint64_t alloc_index = 0;
-
-                // First-fit
-                for (uint64_t i = 0; i < fragments.size(); i++) {
-                    auto len = fragments[i].length;
-                    if (len > size) {
-                        alloc_index = fragments[i].index;
-                        found_fragment = true;
-                        fragments[i].length -= size;
-                        fragments[i].index += size;
-                        break;
-                    } else if (len == size) {
-                        alloc_index = fragments[i].index;
-                        found_fragment = true;
-                        fragments.erase(fragments.begin() + i);
-                        break;
-                    }
-                }
-
-                if (!found_fragment) {
-                    alloc_index = eof;
-                    eof += size;
-                }
-
-                lenmap[alloc_index] = size;
-                mutex.unlock();
-
-                return alloc_index;
+                return allocate_bytes(n * sizeof(T));
             }
 
-            void deallocate(uint64_t index) {
-                mutex.lock();
-                fragments.push_back(cache_fragment{
-                        .index=index,
-                        .length=lenmap[index]
-                });
+            void deallocate(uint64_t index);
 
-                lenmap.erase(index);
-                mutex.unlock();
-            }
+            // Resize the allocation at index to size bytes. Returns its new index.
+            uint64_t reallocate_bytes(uint64_t index, uint64_t size);
+
+            // Returns the index of the allocation bound to name, with the length of its data and its size in
+            // bytes. If there is none and create is set, size bytes are allocated and bound to name.
+            uint64_t attach(const std::string &name, uint64_t size, bool create, uint64_t &length,
+                            uint64_t &capacity);
+
+            // Set the length of the data in the allocation bound to name, which may be less than its size.
+            void set_length(const std::string &name, uint64_t length);
+
+            // Deallocate the allocation bound to name.
+            void release(const std::string &name);
+
+            bool contains(const std::string &name);
+
+            cache_handle handle(uint64_t index);
+
+            compaction_stats compact(const std::function<void(const compaction_stats &)> &progress);
+
+            // Copy length bytes starting at a byte-index into dest, a page segment at a time.
+            // The accesses are counted against owner, if set.
+            void read_range(uint8_t *dest, uint64_t index, uint64_t length, cache_counters *owner = nullptr);
+
+            // Copy length bytes from src into the cache starting at a byte-index, a page segment at a time.
+            // The accesses are counted against owner, if set.
+            void write_range(const uint8_t *src, uint64_t index, uint64_t length, cache_counters *owner = nullptr);
 
             // Read an object from the cache at a byte-index.
-            // Note: This only works for primitives and 1-byte packed structs.
+            // Note: Objects are copied byte for byte, so they must be trivially copyable.
             template<typename T>
-            T read(uint64_t index) {
-                mutex.lock();
-                uint8_t data[sizeof(T)];
-                for (uint64_t i = 0; i < sizeof(T); i++) {
-                    data[i] = get_byte(index + i);
-                }
-
-                mutex.unlock();
-                return *reinterpret_cast<T *>(data);
+            T read(uint64_t index, cache_counters *owner = nullptr) {
+                static_assert(std::is_trivially_copyable_v<T>, "Use a record_array for other types");
+                T obj;
+                read_range(reinterpret_cast<uint8_t *>(&obj), index, sizeof(T), owner);
+                return obj;
             }
 
             // Write an object to the cache at a byte-index.
-            // Note: This only works for primitives and 1-byte packed structs.
+            // Note: Objects are copied byte for byte, so they must be trivially copyable.
             template<typename T>
-            void write(T obj, uint64_t index) {
-                mutex.lock();
-                auto data = reinterpret_cast<uint8_t *>(&obj);
-                for (uint64_t i = 0; i < sizeof(T); i++) {
-                    set_byte(data[i], index + i);
-                }
-                mutex.unlock();
+            void write(T obj, uint64_t index, cache_counters *owner = nullptr) {
+                static_assert(std::is_trivially_copyable_v<T>, "Use a record_array for other types");
+                write_range(reinterpret_cast<const uint8_t *>(&obj), index, sizeof(T), owner);
             }
 
-            ~_icache();
+            // Pin the pages holding bytes [index, index + length) and append the part of the range in each of them
+            // to segments. Fewer pages than the cache has frames can be pinned at a time.
+            void pin_range(uint64_t index, uint64_t length, std::vector<page_segment> &segments, cache_counters *owner);
+
+            // Unpin segments returned by pin_range, marking their bytes dirty if they were written to.
+            void unpin_range(const std::vector<page_segment> &segments, bool written);
+
+            // Hint that bytes [index, index + length) will be read soon.
+            void prefetch(uint64_t index, uint64_t length);
+
+            // Write all dirty data to the page file.
+            void flush();
+
+            compression_stats compression();
+
+            [[nodiscard]] uint64_t page() const {
+                return page_size;
+            }
+
+            // Returns the most pages that can be resident at a time, or UINT64_MAX if the storage is mapped.
+            uint64_t frame_limit();
+
+            // Returns new counters for accesses made on behalf of a virtual_array.
+            std::shared_ptr<cache_counters> attribute();
+
+            cache_stats stats();
+
+            void reset_stats(cache_counters *owner);
+
+            page_frame *surrender() override;
+
+            ~_icache() override;
         };
 
         _icache *_inner{};
@@ -124,12 +437,32 @@ namespace rainman {
 
         cache(FILE *fp, uint64_t size, const Allocator &allocator = Allocator());
 
+        cache(FILE *fp, uint64_t size, const cache_options &options, const Allocator &allocator = Allocator());
+
         cache(const std::string &filename, uint64_t page_size, const Allocator &allocator = Allocator());
 
+        cache(const std::string &filename, uint64_t page_size, const cache_options &options,
+              const Allocator &allocator = Allocator());
+
         cache(const cache &copy);
 
         cache &operator=(const cache &rhs);
 
+        // Returns false for a default-constructed cache, which has no page file.
+        [[nodiscard]] bool valid() const {
+            return _inner != nullptr;
+        }
+
+        [[nodiscard]] uint64_t page_size() const {
+            return _inner->page();
+        }
+
+        // Returns the most pages that can be resident, and so pinned, at a time, or UINT64_MAX if the cache's
+        // storage is memory-mapped.
+        [[nodiscard]] uint64_t frames() const {
+            return _inner->frame_limit();
+        }
+
         template<typename Type>
         uint64_t allocate(uint64_t n) {
             return _inner->template allocate<Type>(n);
@@ -139,18 +472,139 @@ namespace rainman {
             _inner->deallocate(index);
         }
 
+        // Resize the allocation at index to n objects, keeping its contents up to the smaller size. It grows in
+        // place at the end of the page file or into free space right after it, and is copied elsewhere otherwise.
+        // Returns its new index, which its handle and name follow.
+        template<typename Type>
+        uint64_t reallocate(uint64_t index, uint64_t n) {
+            return _inner->reallocate_bytes(index, n * sizeof(Type));
+        }
+
+        // Returns the index of the allocation bound to name, allocating n objects and binding them
+        // to name if there is none. Named allocations are saved in the catalog of a persistent cache.
+        // If capacity is set, the number of objects the allocation has room for is stored in it.
+        template<typename Type>
+        uint64_t attach(const std::string &name, uint64_t n, uint64_t *capacity = nullptr) {
+            uint64_t length, size;
+            auto index = _inner->attach(name, n * sizeof(Type), true, length, size);
+            if (length != n * sizeof(Type)) {
+                throw MemoryErrors::InvalidOperationException("Size mismatch for named allocation: " + name);
+            }
+
+            if (capacity != nullptr) {
+                *capacity = size / sizeof(Type);
+            }
+
+            return index;
+        }
+
+        // Returns the index and the length in bytes of the data of the existing allocation bound to name. If
+        // capacity is set, the size in bytes of the allocation is stored in it.
+        uint64_t attach(const std::string &name, uint64_t &length, uint64_t *capacity = nullptr) {
+            uint64_t size;
+            auto index = _inner->attach(name, 0, false, length, size);
+            if (capacity != nullptr) {
+                *capacity = size;
+            }
+
+            return index;
+        }
+
+        // Set the length in bytes of the data in the allocation bound to name, which attach() returns from then on.
+        // It may be less than the allocation's size, so that the data can grow in place.
+        void set_length(const std::string &name, uint64_t length) {
+            _inner->set_length(name, length);
+        }
+
+        // Deallocate the allocation bound to name.
+        void release(const std::string &name) {
+            _inner->release(name);
+        }
+
+        bool contains(const std::string &name) {
+            return _inner->contains(name);
+        }
+
+        // Returns the handle of the allocation at index, which always holds its current index. compact() may move
+        // an allocation once it has a handle, so its index must be read from the handle from then on.
+        cache_handle handle(uint64_t index) {
+            return _inner->handle(index);
+        }
+
+        // Move the allocations that have a handle towards the start of the page file, and shrink the file to the
+        // space that is left in use. The cache can be used meanwhile, but not the allocations being moved.
+        // progress is called after every allocation moved.
+        compaction_stats compact(const std::function<void(const compaction_stats &)> &progress = {}) {
+            return _inner->compact(progress);
+        }
+
         // Read an object from the cache at a byte-index.
-        // Note: This only works for primitives and 1-byte packed structs.
+        // Note: Objects are copied byte for byte, so they must be trivially copyable.
         template<typename Type>
-        Type read(uint64_t index) {
-            return _inner->template read<Type>(index);
+        Type read(uint64_t index, cache_counters *owner = nullptr) {
+            return _inner->template read<Type>(index, owner);
         }
 
         // Write an object to the cache at a byte-index.
-        // Note: This only works for primitives and 1-byte packed structs.
+        // Note: Objects are copied byte for byte, so they must be trivially copyable.
         template<typename Type>
-        void write(Type obj, uint64_t index) {
-            _inner->template write<Type>(obj, index);
+        void write(Type obj, uint64_t index, cache_counters *owner = nullptr) {
+            _inner->template write<Type>(obj, index, owner);
+        }
+
+        // Bulk-read length bytes starting at a byte-index into dest.
+        void read_range(void *dest, uint64_t index, uint64_t length, cache_counters *owner = nullptr) {
+            _inner->read_range(static_cast<uint8_t *>(dest), index, length, owner);
+        }
+
+        // Bulk-write length bytes from src starting at a byte-index.
+        void write_range(const void *src, uint64_t index, uint64_t length, cache_counters *owner = nullptr) {
+            _inner->write_range(static_cast<const uint8_t *>(src), index, length, owner);
+        }
+
+        // Pin the pages holding bytes [index, index + length) in memory, so that they can be accessed in place
+        // through segments until unpin() is called. The pages are never evicted meanwhile. Accesses that need a frame
+        // while this thread's pins hold every frame throw an InvalidOperationException.
+        void pin(uint64_t index, uint64_t length, std::vector<page_segment> &segments,
+                 cache_counters *owner = nullptr) {
+            _inner->pin_range(index, length, segments, owner);
+        }
+
+        // Unpin segments returned by pin(). If written is set, their bytes are marked dirty.
+        void unpin(const std::vector<page_segment> &segments, bool written) {
+            _inner->unpin_range(segments, written);
+        }
+
+        // Hint that bytes [index, index + length) will be read soon, so that they are loaded in the background.
+        void prefetch(uint64_t index, uint64_t length) {
+            _inner->prefetch(index, length);
+        }
+
+        // Returns compression ratio and codec time for a compressed cache.
+        compression_stats compression() {
+            return _inner->compression();
+        }
+
+        // Returns hit rate, page I/O and free space counters of the cache since it was created or last reset.
+        cache_stats stats() {
+            return _inner->stats();
+        }
+
+        // Reset the counters of the cache and of every virtual_array in it, or only those of owner.
+        // The counts of owner are kept in the cache's totals.
+        void reset_stats(cache_counters *owner = nullptr) {
+            _inner->reset_stats(owner);
+        }
+
+        // Returns new counters for accesses made on behalf of e.g. a virtual_array. Accesses passed these
+        // counters are counted in them instead of the cache's own, and stats() adds them up.
+        std::shared_ptr<cache_counters> attribute() {
+            return _inner->attribute();
+        }
+
+        // Write all dirty data to the page file. Clean pages are never written back.
+        void flush() {
+            _inner->flush();
         }
 
         ~cache();
@@ -0,0 +1,53 @@
+#ifndef RAINMAN_CODEC_H
+#define RAINMAN_CODEC_H
+
+#include <cstdint>
+
+/*
+ * Page codecs for compressed rainman::cache page files.
+ */
+
+namespace rainman {
+    class codec {
+    public:
+        // Compress length bytes from src into dest, which can hold capacity bytes.
+        // Returns the compressed size, or 0 if the result does not fit in capacity.
+        virtual uint64_t compress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t capacity) = 0;
+
+        // Decompress length bytes from src into dest, which must receive exactly dest_length bytes.
+        // Returns false if src is corrupt.
+        virtual bool decompress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t dest_length) = 0;
+
+        virtual ~codec() = default;
+    };
+
+    // A fast LZ77 codec in the style of LZ4 that needs no external dependency.
+    class lz_codec : public codec {
+    private:
+        static constexpr uint64_t hash_bits = 12;
+        static constexpr uint64_t min_match = 4;
+        static constexpr uint64_t max_offset = 0xffff;
+
+    public:
+        uint64_t compress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t capacity) override;
+
+        bool decompress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t dest_length) override;
+    };
+
+    struct compression_stats {
+        uint64_t pages_written{};
+        uint64_t pages_read{};
+        uint64_t pages_stored_raw{};
+        uint64_t bytes_in{};
+        uint64_t bytes_out{};
+        uint64_t compress_ns{};
+        uint64_t decompress_ns{};
+
+        // Uncompressed bytes per stored byte.
+        [[nodiscard]] double ratio() const {
+            return bytes_out == 0 ? 1.0 : (double) bytes_in / (double) bytes_out;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef RAINMAN_COLUMNAR_H
+#define RAINMAN_COLUMNAR_H
+
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "types.h"
+
+namespace rainman {
+    namespace detail {
+        template<typename Member>
+        struct member_traits;
+
+        template<typename Class, typename Field>
+        struct member_traits<Field Class::*> {
+            using owner = Class;
+            using type = Field;
+        };
+
+        template<auto Member>
+        using member_type = typename member_traits<decltype(Member)>::type;
+
+        template<auto A, auto B>
+        constexpr bool same_member() {
+            if constexpr (std::is_same_v<decltype(A), decltype(B)>) {
+                return A == B;
+            } else {
+                return false;
+            }
+        }
+    }
+
+    /*
+     * columnar_array stores an array of aggregates column by column: every field listed in Fields gets its own
+     * virtual_array in the cache, e.g. columnar_array<sample, &sample::x, &sample::y>. A scan that only needs some
+     * fields only reads their columns' pages. Fields that are not listed are not stored and read as
+     * value-initialized.
+     *
+     * A named columnar_array binds its columns to name.0, name.1 and so on.
+     */
+    template<typename Type, auto... Fields>
+    class columnar_array {
+    private:
+        static_assert(std::is_aggregate_v<Type>, "columnar_array needs an aggregate type");
+        static_assert(sizeof...(Fields) > 0, "columnar_array needs at least one field");
+        static_assert((std::is_same_v<typename detail::member_traits<decltype(Fields)>::owner, Type> && ...),
+                      "Fields must be data members of Type");
+
+        // Elements of a column read or written at a time by scans and bulk accessors.
+        static constexpr uint64_t chunk_bytes = 0x10000;
+
+        std::tuple<virtual_array<detail::member_type<Fields>>...> _columns;
+        uint64_t _n{};
+
+        template<std::size_t... I>
+        static auto make_columns(const cache &cache, const std::string &name, uint64_t n,
+                                 std::index_sequence<I...>) {
+            return std::make_tuple(
+                    virtual_array<detail::member_type<Fields>>(cache, name + "." + std::to_string(I), n)...);
+        }
+
+        template<std::size_t... I>
+        void read(Type &obj, uint64_t i, std::index_sequence<I...>) {
+            ((obj.*Fields = std::get<I>(_columns)[i]), ...);
+        }
+
+        template<std::size_t... I>
+        void write(const Type &obj, uint64_t i, std::index_sequence<I...>) {
+            (std::get<I>(_columns).set(obj.*Fields, i), ...);
+        }
+
+        template<auto Field>
+        static constexpr uint64_t column_of() {
+            uint64_t column = 0;
+            uint64_t found = sizeof...(Fields);
+            ((detail::same_member<Fields, Field>() ? found = column++ : column++), ...);
+            return found;
+        }
+
+        template<auto Field>
+        static constexpr void check_field() {
+            static_assert(column_of<Field>() < sizeof...(Fields), "Field is not a column of this array");
+        }
+
+        // Copy field Field of n elements starting at index i into the objects at dest.
+        template<auto Field>
+        void gather(Type *dest, uint64_t i, uint64_t n) {
+            auto &column = std::get<column_of<Field>()>(_columns);
+            std::vector<detail::member_type<Field>> buffer(std::min<uint64_t>(n, chunk_size<Field>()));
+
+            for (uint64_t done = 0; done < n; done += buffer.size()) {
+                auto count = std::min<uint64_t>(buffer.size(), n - done);
+                column.get_range(buffer.data(), i + done, count);
+                for (uint64_t j = 0; j < count; j++) {
+                    dest[done + j].*Field = buffer[j];
+                }
+            }
+        }
+
+        // Copy field Field of the n objects at src into the elements starting at index i.
+        template<auto Field>
+        void scatter(const Type *src, uint64_t i, uint64_t n) {
+            auto &column = std::get<column_of<Field>()>(_columns);
+            std::vector<detail::member_type<Field>> buffer(std::min<uint64_t>(n, chunk_size<Field>()));
+
+            for (uint64_t done = 0; done < n; done += buffer.size()) {
+                auto count = std::min<uint64_t>(buffer.size(), n - done);
+                for (uint64_t j = 0; j < count; j++) {
+                    buffer[j] = src[done + j].*Field;
+                }
+                column.set_range(buffer.data(), i + done, count);
+            }
+        }
+
+        template<auto Field>
+        static constexpr uint64_t chunk_size() {
+            return std::max<uint64_t>(1, chunk_bytes / sizeof(detail::member_type<Field>));
+        }
+
+    public:
+        columnar_array(const cache &cache, uint64_t n)
+                : _columns(virtual_array<detail::member_type<Fields>>(cache, n)...), _n(n) {}
+
+        // Attach to the columns of the array named name, creating them with n elements if they do not exist.
+        columnar_array(const cache &cache, const std::string &name, uint64_t n)
+                : _columns(make_columns(cache, name, n, std::make_index_sequence<sizeof...(Fields)>())), _n(n) {}
+
+        Type operator[](uint64_t i) {
+            Type obj{};
+            read(obj, i, std::make_index_sequence<sizeof...(Fields)>());
+            return obj;
+        }
+
+        void set(const Type &obj, uint64_t i) {
+            write(obj, i, std::make_index_sequence<sizeof...(Fields)>());
+        }
+
+        // Copy n elements starting at index i into dest, a column at a time.
+        void get_range(Type *dest, uint64_t i, uint64_t n) {
+            if (i + n > _n) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            for (uint64_t j = 0; j < n; j++) {
+                dest[j] = Type{};
+            }
+            (gather<Fields>(dest, i, n), ...);
+        }
+
+        // Copy n elements from src into the array starting at index i, a column at a time.
+        void set_range(const Type *src, uint64_t i, uint64_t n) {
+            if (i + n > _n) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            (scatter<Fields>(src, i, n), ...);
+        }
+
+        // Returns the column of Field, which shares its storage with the array.
+        template<auto Field>
+        virtual_array<detail::member_type<Field>> &column() {
+            check_field<Field>();
+            return std::get<column_of<Field>()>(_columns);
+        }
+
+        // Copy field Field of n elements starting at index i into dest, reading only its column.
+        template<auto Field>
+        void get_column(detail::member_type<Field> *dest, uint64_t i, uint64_t n) {
+            check_field<Field>();
+            column<Field>().get_range(dest, i, n);
+        }
+
+        // Copy n values of field Field from src into the elements starting at index i, writing only its column.
+        template<auto Field>
+        void set_column(const detail::member_type<Field> *src, uint64_t i, uint64_t n) {
+            check_field<Field>();
+            column<Field>().set_range(src, i, n);
+        }
+
+        // Call fn(index, value) with field Field of elements [begin, end), reading only its column in large chunks.
+        template<auto Field, typename Function>
+        void scan(uint64_t begin, uint64_t end, Function fn) {
+            check_field<Field>();
+
+            end = std::min(end, _n);
+            std::vector<detail::member_type<Field>> buffer(chunk_size<Field>());
+
+            for (auto i = begin; i < end; i += buffer.size()) {
+                auto count = std::min<uint64_t>(buffer.size(), end - i);
+                get_column<Field>(buffer.data(), i, count);
+                for (uint64_t j = 0; j < count; j++) {
+                    fn(i + j, buffer[j]);
+                }
+            }
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _n;
+        }
+
+        // Returns the accesses and page I/O of all columns since they were created or last reset.
+        [[nodiscard]] cache_stats stats() const {
+            cache_stats result{};
+            std::apply([&result](auto &...column) {
+                ((result += column.stats()), ...);
+            }, _columns);
+
+            return result;
+        }
+    };
+}
+
+#endif
@@ -18,6 +18,19 @@ namespace MemoryErrors {
         }
     };
 
+    class IOException : public std::exception {
+    private:
+        std::string msg;
+    public:
+        IOException(const std::string &msg) {
+            this->msg = "rainman: " + msg;
+        }
+
+        [[nodiscard]] const char *what() const noexcept override {
+            return msg.c_str();
+        }
+    };
+
     class PeakLimitReachedException : public std::exception {
     public:
         PeakLimitReachedException() = default;
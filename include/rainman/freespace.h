@@ -0,0 +1,84 @@
+#ifndef RAINMAN_FREESPACE_H
+#define RAINMAN_FREESPACE_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace rainman {
+    /*
+     * free_space manages the free regions of a cache's page file. Free regions are kept in an address-ordered
+     * map, so that neighbours are merged when a region is released, and in power-of-two size bins for
+     * O(log n) best-fit allocation. A free region that reaches the end of the file is trimmed off instead.
+     */
+    class free_space {
+    private:
+        static constexpr uint64_t n_bins = 64;
+
+        std::map<uint64_t, uint64_t> _regions{};
+        std::set<std::pair<uint64_t, uint64_t>> _bins[n_bins]{};
+        uint64_t _end{};
+        uint64_t _free_bytes{};
+
+        static uint64_t bin_of(uint64_t length);
+
+        void insert(uint64_t index, uint64_t length);
+
+        void erase(uint64_t index, uint64_t length);
+
+    public:
+        static constexpr uint64_t npos = UINT64_MAX;
+
+        struct region {
+            uint64_t index;
+            uint64_t length;
+        };
+
+        free_space() = default;
+
+        explicit free_space(uint64_t end) : _end(end) {}
+
+        // Returns the index of a free region of size bytes, growing the end of the file if none fits.
+        uint64_t allocate(uint64_t size);
+
+        // Take size bytes starting at index, if they are free: either index is the end of the file, or a free
+        // region starts at index and is long enough or reaches the end of the file, which grows as needed.
+        bool extend(uint64_t index, uint64_t size);
+
+        // Returns the index of the lowest free region of size bytes that ends at or before limit, or npos.
+        uint64_t allocate_below(uint64_t size, uint64_t limit);
+
+        // Return [index, index + length) to the free regions, merging it with its neighbours. Returns the merged
+        // region, which is no longer a free region if it reached the end of the file and was trimmed off.
+        region release(uint64_t index, uint64_t length);
+
+        // Restore a free region without merging, e.g. when loading a saved catalog.
+        void restore(uint64_t index, uint64_t length);
+
+        // Returns the free region starting right at index, if any.
+        bool region_at(uint64_t index, region &result) const;
+
+        // Returns the end of the file, i.e. the first byte past the last allocation.
+        [[nodiscard]] uint64_t end() const {
+            return _end;
+        }
+
+        void end(uint64_t end) {
+            _end = end;
+        }
+
+        [[nodiscard]] uint64_t free_bytes() const {
+            return _free_bytes;
+        }
+
+        [[nodiscard]] uint64_t region_count() const {
+            return _regions.size();
+        }
+
+        [[nodiscard]] std::vector<region> regions() const;
+    };
+}
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef RAINMAN_HASH_MAP_H
+#define RAINMAN_HASH_MAP_H
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <vector>
+#include "arena.h"
+#include "types.h"
+
+namespace rainman {
+    /*
+     * virtual_hash_map is a hash map whose buckets are pages of a cache, so that it can hold more entries than fit
+     * in memory. It uses linear hashing: when the load factor is exceeded, the next bucket in turn is split in
+     * two, so the map grows a bucket at a time and never rehashes all of it. A bucket that fills up is chained to
+     * overflow pages.
+     *
+     * Buckets are page-aligned and accessed in place through pins, so a lookup that does not hit an overflow page
+     * touches exactly one page. The pages come from a page_arena, so they are never moved, and share the cache's
+     * frames (and buffer pool) with everything else in it. The map pins one page at a time, so it works with a
+     * single frame. Keys and values are stored byte for byte, so they must be trivially copyable.
+     *
+     * A virtual_hash_map is not persistent and not thread-safe.
+     */
+    template<typename Key, typename Value, typename Hash = std::hash<Key>>
+    class virtual_hash_map {
+    private:
+        static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                      "virtual_hash_map stores keys and values byte for byte");
+
+        static constexpr uint64_t npos = UINT64_MAX;
+
+        struct bucket_header {
+            uint64_t count;
+            uint64_t overflow;
+        };
+
+        struct entry {
+            Key key;
+            Value value;
+        };
+
+        cache _cache;
+        page_arena _arena;
+        std::shared_ptr<cache_counters> _counters{};
+        Hash _hash{};
+        double _max_load{};
+        uint64_t _page{};
+        uint64_t _capacity{};
+
+        // Linear hashing state: the table has _initial << _level buckets, plus the _next that have been split.
+        uint64_t _initial{};
+        uint64_t _level{};
+        uint64_t _next{};
+        uint64_t _n{};
+
+        // The page of every bucket.
+        std::vector<uint64_t> _buckets{};
+
+        [[nodiscard]] uint64_t bucket_count() const {
+            return (_initial << _level) + _next;
+        }
+
+        [[nodiscard]] uint64_t bucket_index(uint64_t bucket) const {
+            return _buckets[bucket];
+        }
+
+        uint64_t hash(const Key &key) const {
+            // Mix the hash, since std::hash is the identity for integers and buckets are picked by its low bits.
+            uint64_t h = _hash(key);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        [[nodiscard]] uint64_t bucket_of(uint64_t h) const {
+            auto bucket = h % (_initial << _level);
+            if (bucket < _next) {
+                bucket = h % (_initial << (_level + 1));
+            }
+
+            return bucket;
+        }
+
+        template<typename Element>
+        pinned_view<Element> pin(uint64_t index) {
+            return pinned_view<Element>(_cache, index, _page, _counters.get());
+        }
+
+        static bucket_header *header(const pinned_view<uint8_t> &page) {
+            return reinterpret_cast<bucket_header *>(page.span().data());
+        }
+
+        static entry *entries(const pinned_view<uint8_t> &page) {
+            return reinterpret_cast<entry *>(page.span().data() + sizeof(bucket_header));
+        }
+
+        static const bucket_header *header(const pinned_view<const uint8_t> &page) {
+            return reinterpret_cast<const bucket_header *>(page.span().data());
+        }
+
+        static const entry *entries(const pinned_view<const uint8_t> &page) {
+            return reinterpret_cast<const entry *>(page.span().data() + sizeof(bucket_header));
+        }
+
+        void clear_page(uint64_t index) {
+            bucket_header empty{.count=0, .overflow=npos};
+            _cache.write(empty, index, _counters.get());
+        }
+
+        uint64_t take_page() {
+            auto index = _arena.allocate();
+            clear_page(index);
+            return index;
+        }
+
+        // Append an entry to the chain of bucket, which does not hold its key.
+        void append(uint64_t bucket, const entry &e) {
+            auto index = bucket_index(bucket);
+
+            while (true) {
+                bucket_header head{};
+                {
+                    auto page = pin<uint8_t>(index);
+                    head = *header(page);
+                    if (head.count < _capacity) {
+                        entries(page)[header(page)->count++] = e;
+                        return;
+                    }
+                }
+
+                // The page is unpinned while the overflow page is taken, so that a map needs a single frame.
+                if (head.overflow == npos) {
+                    head.overflow = take_page();
+                    _cache.write(head.overflow, index + offsetof(bucket_header, overflow), _counters.get());
+                }
+
+                index = head.overflow;
+            }
+        }
+
+        // Split the next bucket in turn, moving the entries that now hash past the current level to a new bucket.
+        void split() {
+            auto bucket = _next;
+            std::vector<entry> moved;
+            std::vector<uint64_t> chain;
+
+            auto index = bucket_index(bucket);
+            while (index != npos) {
+                auto page = pin<const uint8_t>(index);
+                auto *head = header(page);
+                moved.insert(moved.end(), entries(page), entries(page) + head->count);
+                chain.push_back(index);
+                index = head->overflow;
+            }
+
+            // The chain's overflow pages are reused by the next splits and appends.
+            for (uint64_t i = 1; i < chain.size(); i++) {
+                _arena.release(chain[i]);
+            }
+
+            clear_page(chain[0]);
+            _buckets.push_back(take_page());
+
+            if (++_next == _initial << _level) {
+                _next = 0;
+                _level++;
+            }
+
+            for (auto &e : moved) {
+                append(bucket_of(hash(e.key)), e);
+            }
+        }
+
+        // Add an entry for a key that the map does not hold.
+        void add(const Key &key, const Value &value) {
+            append(bucket_of(hash(key)), entry{.key=key, .value=value});
+            _n++;
+
+            if ((double) _n > _max_load * (double) (bucket_count() * _capacity)) {
+                split();
+            }
+        }
+
+        // Returns the byte-index of the entry holding key, or npos if there is none. Its value is copied to value,
+        // if set.
+        uint64_t locate(const Key &key, Value *value = nullptr) {
+            auto index = bucket_index(bucket_of(hash(key)));
+
+            while (index != npos) {
+                auto page = pin<const uint8_t>(index);
+                auto *head = header(page);
+                for (uint64_t i = 0; i < head->count; i++) {
+                    if (entries(page)[i].key == key) {
+                        if (value != nullptr) {
+                            *value = entries(page)[i].value;
+                        }
+
+                        return index + sizeof(bucket_header) + i * sizeof(entry);
+                    }
+                }
+
+                index = head->overflow;
+            }
+
+            return npos;
+        }
+
+    public:
+        // Create an empty map with initial_buckets buckets. A bucket is split when the map holds more than
+        // max_load times the entries that fit in its buckets' pages.
+        explicit virtual_hash_map(const cache &cache, uint64_t initial_buckets = 16, double max_load = 0.75,
+                                  const Hash &hash = Hash())
+                : _cache(cache), _arena(cache), _hash(hash), _max_load(max_load),
+                  _initial(std::max<uint64_t>(initial_buckets, 1)) {
+            _counters = _cache.attribute();
+            _page = _arena.page_size();
+            if (_page <= sizeof(bucket_header) + sizeof(entry)) {
+                throw MemoryErrors::InvalidOperationException("Hash map entries do not fit in a page");
+            }
+
+            _capacity = (_page - sizeof(bucket_header)) / sizeof(entry);
+
+            for (uint64_t i = 0; i < _initial; i++) {
+                _buckets.push_back(take_page());
+            }
+        }
+
+        virtual_hash_map(const virtual_hash_map &) = delete;
+
+        virtual_hash_map &operator=(const virtual_hash_map &) = delete;
+
+        // Returns the value of key, if the map holds it.
+        std::optional<Value> find(const Key &key) {
+            Value value;
+            if (locate(key, &value) == npos) {
+                return std::nullopt;
+            }
+
+            return value;
+        }
+
+        bool contains(const Key &key) {
+            return locate(key) != npos;
+        }
+
+        // Insert key with value, or assign value to key if the map holds it already. Returns whether key was
+        // inserted.
+        bool insert_or_assign(const Key &key, const Value &value) {
+            auto index = locate(key);
+            if (index != npos) {
+                _cache.write(value, index + offsetof(entry, value), _counters.get());
+                return false;
+            }
+
+            add(key, value);
+            return true;
+        }
+
+        // Insert key with value unless the map holds key already. Returns whether key was inserted.
+        bool insert(const Key &key, const Value &value) {
+            if (contains(key)) {
+                return false;
+            }
+
+            add(key, value);
+            return true;
+        }
+
+        // Remove key from the map. Returns whether the map held it.
+        bool erase(const Key &key) {
+            auto index = locate(key);
+            if (index == npos) {
+                return false;
+            }
+
+            // Move the last entry of the page into the hole.
+            auto page = pin<uint8_t>(index / _page * _page);
+            auto *head = header(page);
+            entries(page)[(index % _page - sizeof(bucket_header)) / sizeof(entry)] = entries(page)[--head->count];
+            _n--;
+            return true;
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _n;
+        }
+
+        [[nodiscard]] uint64_t buckets() const {
+            return bucket_count();
+        }
+
+        [[nodiscard]] uint64_t overflow_pages() const {
+            return _arena.pages() - _buckets.size();
+        }
+
+        // Returns the accesses and page I/O of the map since it was created or last reset.
+        [[nodiscard]] cache_stats stats() const {
+            return _counters->snapshot();
+        }
+
+        void reset_stats() {
+            _cache.reset_stats(_counters.get());
+        }
+    };
+}
+
+#endif
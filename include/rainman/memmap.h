@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <type_traits>
 
 namespace rainman {
     struct map_elem {
@@ -12,6 +14,7 @@ namespace rainman {
         uint64_t count = 0;
         const char *type_name = nullptr;
         bool is_raw = false;
+        uint64_t alignment = 0;
         map_elem *next = nullptr;
         map_elem *next_iter = nullptr;
         map_elem *prev_iter = nullptr;
@@ -26,16 +29,22 @@ namespace rainman {
         template <typename Type>
         void free_mem(map_elem *elem) {
             if (elem->is_raw) {
-                Type *objects = reinterpret_cast<Type*>(elem->ptr);
-                auto count = elem->count;
-
-                for (uint64_t i = 0; i < count; i++) {
-                    _mutex.unlock();
-                    objects[count - i - 1].~Type();
-                    _mutex.lock();
+                if constexpr (!std::is_trivially_destructible_v<Type>) {
+                    Type *objects = reinterpret_cast<Type*>(elem->ptr);
+                    auto count = elem->count;
+
+                    for (uint64_t i = 0; i < count; i++) {
+                        _mutex.unlock();
+                        objects[count - i - 1].~Type();
+                        _mutex.lock();
+                    }
                 }
 
-                operator delete[](elem->ptr);
+                if (elem->alignment != 0) {
+                    operator delete[](elem->ptr, std::align_val_t(elem->alignment));
+                } else {
+                    operator delete[](elem->ptr);
+                }
             } else {
                 _mutex.unlock();
                 delete[] static_cast<Type*>(elem->ptr);
@@ -8,6 +8,7 @@
 #include <vector>
 #include <unordered_map>
 #include <typeinfo>
+#include <type_traits>
 #include "errors.h"
 #include "memmap.h"
 
@@ -72,6 +73,46 @@ namespace rainman {
             return static_cast<Type*>(elem->ptr);
         }
 
+        // Allocate n_elems trivial objects at an address that is a multiple of alignment, e.g. for direct I/O.
+        template<typename Type>
+        Type *r_malloc_aligned(uint64_t n_elems, uint64_t alignment) {
+            static_assert(std::is_trivial_v<Type>, "Only trivial types can be allocated with an alignment");
+
+            lock();
+
+            uint64_t curr_alloc_size = sizeof(Type) * n_elems;
+
+            if (_peak_size != 0 && _allocation_size + curr_alloc_size > _peak_size) {
+                unlock();
+                throw MemoryErrors::PeakLimitReachedException();
+            }
+
+            if (_parent != nullptr &&
+                _parent->_peak_size != 0 &&
+                _parent->get_alloc_size() + curr_alloc_size > _parent->get_peak_size()) {
+                unlock();
+                throw MemoryErrors::PeakLimitReachedException();
+            }
+
+            auto elem = new map_elem;
+
+            elem->alloc_size = n_elems * sizeof(Type);
+            elem->count = n_elems;
+            elem->ptr = operator new[](elem->alloc_size, std::align_val_t(alignment));
+            elem->type_name = typeid(Type).name();
+            elem->next = nullptr;
+            elem->is_raw = true;
+            elem->alignment = alignment;
+
+            _memmap->add(elem);
+
+            update(_allocation_size + elem->alloc_size, _n_allocations + 1);
+
+            unlock();
+
+            return static_cast<Type*>(elem->ptr);
+        }
+
         template<typename Type>
         void r_free(Type *ptr) {
             if (ptr == nullptr) {
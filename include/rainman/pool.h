@@ -0,0 +1,131 @@
+#ifndef RAINMAN_POOL_H
+#define RAINMAN_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "utils.h"
+
+namespace rainman {
+    // A page-sized buffer holding one resident page of a cache.
+    // The owning cache's page table latch guards owner, offset, valid and loading; they are atomic so that a
+    // pinned frame can be validated without it. Writers hold the frame latch and bump version around every change
+    // to the page data, so that readers never lock: they retry their copy if version moved (a seqlock).
+    // The frame latch also guards the dirty range and dirty_since, which orders frames by when they became dirty.
+    // A pinned frame is never evicted.
+    struct page_frame {
+        std::atomic<uint64_t> owner{};
+        std::atomic<uint64_t> offset{};
+        uint8_t *data{};
+        uint64_t size{};
+        std::atomic<bool> valid{};
+        std::atomic<bool> loading{};
+        std::atomic<bool> dirty{};
+        uint64_t dirty_begin{};
+        uint64_t dirty_end{};
+        uint64_t dirty_since{};
+        std::atomic<uint64_t> pins{};
+        std::atomic<bool> referenced{};
+        std::atomic<uint64_t> version{};
+        std::mutex latch{};
+    };
+
+    // A cache that draws its frames from a buffer_pool.
+    class pool_member {
+    public:
+        // Give up a cold, unpinned frame, written back and detached from its page, without waiting for other
+        // threads. Returns nullptr if there is none or the cache is busy.
+        virtual page_frame *surrender() = 0;
+
+        virtual ~pool_member() = default;
+    };
+
+    struct pool_stats {
+        uint64_t budget{};
+        uint64_t used{};
+        uint64_t caches{};
+        uint64_t frames{};
+        uint64_t reclaimed{};
+    };
+
+    /*
+     * buffer_pool is a memory budget for page frames shared by several page-buffered caches. Caches allocate frames
+     * from the pool's Allocator while the budget allows, so the memory shows up in its memmgr. Once the budget is
+     * used up, a cache that holds less than its fair share (the budget split evenly between the caches) takes
+     * cold frames from the caches furthest above theirs. Otherwise it evicts its own coldest pages. A cache can
+     * always get one frame, even over the budget.
+     *
+     * Frames are kept until the pool is destroyed, so that a frame can move between caches while other threads
+     * still refer to it. The caches keep the pool alive.
+     */
+    class buffer_pool : private ReferenceCounter {
+    private:
+        class _ipool {
+        private:
+            struct member {
+                pool_member *cache;
+                uint64_t bytes;
+            };
+
+            uint64_t budget{};
+            uint64_t used{};
+            uint64_t reclaimed{};
+            uint64_t n_frames{};
+            std::vector<member> members;
+
+            // Frames that belong to no cache and have no data.
+            std::vector<page_frame *> spare;
+
+            std::mutex mutex{};
+            Allocator _allocator{};
+
+            member *find(pool_member *cache);
+
+            // Take a frame from the caches furthest above their fair share until size bytes fit in the budget.
+            // Expects the mutex to be held.
+            bool reclaim(pool_member *cache, uint64_t size);
+
+        public:
+            _ipool(uint64_t budget, const Allocator &allocator);
+
+            void join(pool_member *cache);
+
+            // Stop taking frames from cache. Its frames still count against the budget until they are released.
+            void leave(pool_member *cache);
+
+            // Returns a frame with size bytes of data, aligned to alignment, for cache, or nullptr if cache has to
+            // evict its own pages.
+            page_frame *acquire(pool_member *cache, uint64_t size, uint64_t alignment);
+
+            // Return a frame of cache to the pool. The frame must not be reachable by other threads.
+            void release(pool_member *cache, page_frame *frame);
+
+            pool_stats stats();
+
+            ~_ipool();
+        };
+
+        _ipool *_inner{};
+        Allocator _allocator;
+
+        friend class cache;
+    public:
+        buffer_pool() = default;
+
+        explicit buffer_pool(uint64_t budget, const Allocator &allocator = Allocator());
+
+        buffer_pool(const buffer_pool &copy);
+
+        buffer_pool &operator=(const buffer_pool &rhs);
+
+        // Returns the budget and the bytes used by the caches' frames.
+        pool_stats stats() {
+            return _inner->stats();
+        }
+
+        ~buffer_pool();
+    };
+}
+
+#endif
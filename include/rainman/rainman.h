@@ -3,5 +3,10 @@
 
 #include "types.h"
 #include "context.h"
+#include "columnar.h"
+#include "algorithm.h"
+#include "records.h"
+#include "hash_map.h"
+#include "btree.h"
 
 #endif
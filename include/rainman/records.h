@@ -0,0 +1,330 @@
+#ifndef RAINMAN_RECORDS_H
+#define RAINMAN_RECORDS_H
+
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "serializer.h"
+#include "types.h"
+
+namespace rainman {
+    /*
+     * blob_view is a record of a virtual_blob_array. Records that lie within one page are read in place from the
+     * pinned page, the others are copied. The page stays pinned while the view is alive, so it holds a cache frame:
+     * accesses that need a frame while the calling thread's views and pins hold all of them throw an
+     * InvalidOperationException.
+     */
+    class blob_view {
+    private:
+        std::optional<pinned_view<const uint8_t>> _pin{};
+        std::vector<uint8_t> _copy{};
+        std::span<const uint8_t> _data{};
+
+        friend class virtual_blob_array;
+
+    public:
+        [[nodiscard]] std::span<const uint8_t> bytes() const {
+            return _data;
+        }
+
+        [[nodiscard]] std::string_view str() const {
+            return {reinterpret_cast<const char *>(_data.data()), _data.size()};
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _data.size();
+        }
+
+        // Returns whether the record is read in place from cache memory.
+        [[nodiscard]] bool pinned() const {
+            return _pin.has_value();
+        }
+    };
+
+    /*
+     * virtual_blob_array stores variable-length byte records packed densely into a byte array in a cache, next to
+     * an array with the end offset of every record. A record that fits in a page but would straddle a page
+     * boundary is moved to the start of the next page, so that view() can return it without copying. The padding
+     * is kept in the top bits of the record's end offset, which leaves 48 bits for offsets.
+     *
+     * Records are appended and never replaced. append_range() packs a batch of records into one buffer and writes
+     * it with a single bulk write. Padding is computed for where the byte array is when records are appended; if
+     * the array moves to a different page alignment later, views of such records copy them instead.
+     *
+     * A named virtual_blob_array is stored as name.ends and name.bytes and can be re-attached by name.
+     */
+    class virtual_blob_array {
+    private:
+        static constexpr uint64_t offset_bits = 48;
+        static constexpr uint64_t offset_mask = (1ULL << offset_bits) - 1;
+        static constexpr uint64_t max_padding = (1ULL << (64 - offset_bits)) - 1;
+
+        virtual_array<uint64_t> _ends;
+        virtual_array<uint8_t> _bytes;
+
+        template<typename Element>
+        static virtual_array<Element> open(cache cache, const std::string &name) {
+            if (cache.contains(name)) {
+                return virtual_array<Element>(cache, name);
+            }
+
+            return virtual_array<Element>(cache, name, 0);
+        }
+
+        // Returns the byte offsets [begin, end) of record i.
+        std::pair<uint64_t, uint64_t> bounds(uint64_t i) {
+            if (i >= size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            uint64_t ends[2]{};
+            if (i == 0) {
+                ends[1] = _ends[0];
+            } else {
+                _ends.get_range(ends, i - 1, 2);
+            }
+
+            auto end = ends[1] & offset_mask;
+            return {(ends[0] & offset_mask) + (ends[1] >> offset_bits), end};
+        }
+
+    public:
+        explicit virtual_blob_array(const cache &cache) : _ends(cache, 0), _bytes(cache, 0) {}
+
+        // Attach to the blob array named name, creating an empty one if it does not exist.
+        virtual_blob_array(const cache &cache, const std::string &name)
+                : _ends(open<uint64_t>(cache, name + ".ends")), _bytes(open<uint8_t>(cache, name + ".bytes")) {}
+
+        // Make room for n more records of bytes bytes in total, so that building the array does not move it.
+        void reserve(uint64_t n, uint64_t bytes) {
+            _ends.reserve(size() + n);
+            _bytes.reserve(this->bytes() + bytes);
+        }
+
+        // Append n records, where length(i) returns the length of record i and write(i, dest) fills it in. Each is
+        // called once per record, in order.
+        template<typename Length, typename Write>
+        void append_records(uint64_t n, Length length, Write write) {
+            auto page = _bytes.parent().page_size();
+            auto base = _bytes.size();
+            auto index = _bytes.index();
+            auto offset = base;
+
+            std::vector<uint64_t> ends(n);
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t size = length(i);
+                uint64_t in_page = (index + offset) % page;
+                uint64_t padding = 0;
+                if (size <= page && in_page + size > page && page - in_page <= max_padding) {
+                    padding = page - in_page;
+                }
+
+                offset += padding + size;
+                if (offset > offset_mask) {
+                    throw MemoryErrors::InvalidOperationException("Blob array exceeds 2^48 bytes");
+                }
+
+                ends[i] = offset | padding << offset_bits;
+            }
+
+            std::vector<uint8_t> buffer(offset - base);
+            auto begin = base;
+            for (uint64_t i = 0; i < n; i++) {
+                write(i, buffer.data() + (begin + (ends[i] >> offset_bits) - base));
+                begin = ends[i] & offset_mask;
+            }
+
+            _bytes.append_range(buffer.data(), buffer.size());
+            _ends.append_range(ends.data(), n);
+        }
+
+        void push_back(const void *data, uint64_t length) {
+            append_records(1, [length](uint64_t) { return length; }, [data, length](uint64_t, uint8_t *dest) {
+                std::memcpy(dest, data, length);
+            });
+        }
+
+        // Append every record of records, a range of contiguous byte or char sequences such as strings or spans.
+        template<typename Range>
+        void append_range(const Range &records) {
+            // append_records() asks for the records in order, so each of its passes walks an iterator of its own.
+            auto lengths = std::begin(records);
+            auto sources = std::begin(records);
+
+            append_records((uint64_t) std::size(records), [&lengths](uint64_t) {
+                auto &&record = *lengths++;
+                return (uint64_t) (std::size(record) * sizeof(*std::data(record)));
+            }, [&sources](uint64_t, uint8_t *dest) {
+                auto &&record = *sources++;
+                std::memcpy(dest, std::data(record), std::size(record) * sizeof(*std::data(record)));
+            });
+        }
+
+        // Returns a copy of record i.
+        std::vector<uint8_t> get(uint64_t i) {
+            auto [begin, end] = bounds(i);
+            std::vector<uint8_t> result(end - begin);
+            _bytes.get_range(result.data(), begin, result.size());
+            return result;
+        }
+
+        // Returns record i, in place in cache memory if it lies within one page.
+        blob_view view(uint64_t i) {
+            auto [begin, end] = bounds(i);
+            blob_view result;
+            if (begin == end) {
+                return result;
+            }
+
+            auto page = _bytes.parent().page_size();
+            auto in_page = (_bytes.index() + begin) % page;
+            if (in_page + (end - begin) <= page) {
+                result._pin.emplace(_bytes.pin(begin, end - begin));
+                if (result._pin->segments().size() == 1) {
+                    result._data = result._pin->span();
+                    return result;
+                }
+
+                result._pin.reset();
+            }
+
+            result._copy.resize(end - begin);
+            _bytes.get_range(result._copy.data(), begin, result._copy.size());
+            result._data = result._copy;
+            return result;
+        }
+
+        // Returns the length of record i.
+        uint64_t length(uint64_t i) {
+            auto [begin, end] = bounds(i);
+            return end - begin;
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _ends.size();
+        }
+
+        // Returns the bytes taken by the records, including the padding between them.
+        [[nodiscard]] uint64_t bytes() const {
+            return _bytes.size();
+        }
+
+        // Returns the accesses and page I/O of the records and their offsets.
+        [[nodiscard]] cache_stats stats() const {
+            auto result = _bytes.stats();
+            result += _ends.stats();
+            return result;
+        }
+    };
+
+    /*
+     * virtual_string_array is a virtual_blob_array of strings.
+     */
+    class virtual_string_array {
+    private:
+        virtual_blob_array _blobs;
+
+    public:
+        explicit virtual_string_array(const cache &cache) : _blobs(cache) {}
+
+        // Attach to the string array named name, creating an empty one if it does not exist.
+        virtual_string_array(const cache &cache, const std::string &name) : _blobs(cache, name) {}
+
+        std::string operator[](uint64_t i) {
+            auto view = _blobs.view(i);
+            return std::string(view.str());
+        }
+
+        // Returns string i, in place in cache memory if it lies within one page. The view's str() stays valid
+        // while the view is alive.
+        blob_view view(uint64_t i) {
+            return _blobs.view(i);
+        }
+
+        // Make room for n more strings of bytes bytes in total.
+        void reserve(uint64_t n, uint64_t bytes) {
+            _blobs.reserve(n, bytes);
+        }
+
+        void push_back(std::string_view value) {
+            _blobs.push_back(value.data(), value.size());
+        }
+
+        // Append every string of strings, a range of strings or string views.
+        template<typename Range>
+        void append_range(const Range &strings) {
+            _blobs.append_range(strings);
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _blobs.size();
+        }
+
+        [[nodiscard]] uint64_t bytes() const {
+            return _blobs.bytes();
+        }
+
+        [[nodiscard]] cache_stats stats() const {
+            return _blobs.stats();
+        }
+    };
+
+    /*
+     * record_array stores values of any serializable type, such as strings, vectors or aggregates that list their
+     * serialized_fields, as encoded records of a virtual_blob_array.
+     *
+     * Records are appended and read whole; a record cannot be replaced in place. append_range() encodes a batch
+     * of records into one buffer and writes it with a single bulk write, so it is much faster than push_back()
+     * for building an array.
+     *
+     * A named record_array can be re-attached by name.
+     */
+    template<serializable Type>
+    class record_array {
+    private:
+        virtual_blob_array _blobs;
+
+    public:
+        explicit record_array(const cache &cache) : _blobs(cache) {}
+
+        // Attach to the record array named name, creating an empty one if it does not exist.
+        record_array(const cache &cache, const std::string &name) : _blobs(cache, name) {}
+
+        Type operator[](uint64_t i) {
+            auto view = _blobs.view(i);
+            return serializer<Type>::decode(view.bytes().data(), view.size());
+        }
+
+        void push_back(const Type &value) {
+            append_range(&value, 1);
+        }
+
+        // Append n records from src.
+        void append_range(const Type *src, uint64_t n) {
+            _blobs.append_records(n, [src](uint64_t i) {
+                return serializer<Type>::size(src[i]);
+            }, [src](uint64_t i, uint8_t *dest) {
+                serializer<Type>::encode(src[i], dest);
+            });
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _blobs.size();
+        }
+
+        // Returns the bytes taken by the encoded records.
+        [[nodiscard]] uint64_t bytes() const {
+            return _blobs.bytes();
+        }
+
+        // Returns the accesses and page I/O of the records and their offsets.
+        [[nodiscard]] cache_stats stats() const {
+            return _blobs.stats();
+        }
+    };
+}
+
+#endif
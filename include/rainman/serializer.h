@@ -0,0 +1,196 @@
+#ifndef RAINMAN_SERIALIZER_H
+#define RAINMAN_SERIALIZER_H
+
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "errors.h"
+
+namespace rainman {
+    /*
+     * serializer<Type> converts values of Type to and from the bytes stored in a cache. A serializer provides
+     *
+     *   static uint64_t size(const Type &value);               // the encoded length of value
+     *   static void encode(const Type &value, uint8_t *dest);  // write size(value) bytes to dest
+     *   static Type decode(const uint8_t *src, uint64_t length);
+     *
+     * Trivially copyable types are copied byte for byte. Strings and vectors are built in. An aggregate can list
+     * its fields in a static constexpr member serialized_fields, e.g. std::make_tuple(&user::id, &user::name), to
+     * be encoded field by field. Other types need a specialization of serializer.
+     */
+    template<typename Type, typename = void>
+    struct serializer;
+
+    template<typename Type>
+    concept serializable = requires(const Type &value, uint8_t *dest, const uint8_t *src, uint64_t length) {
+        { serializer<Type>::size(value) } -> std::convertible_to<uint64_t>;
+        serializer<Type>::encode(value, dest);
+        { serializer<Type>::decode(src, length) } -> std::same_as<Type>;
+    };
+
+    template<typename Type>
+    struct serializer<Type, std::enable_if_t<std::is_trivially_copyable_v<Type>>> {
+        static constexpr uint64_t size(const Type &) {
+            return sizeof(Type);
+        }
+
+        static void encode(const Type &value, uint8_t *dest) {
+            std::memcpy(dest, &value, sizeof(Type));
+        }
+
+        static Type decode(const uint8_t *src, uint64_t length) {
+            if (length != sizeof(Type)) {
+                throw MemoryErrors::InvalidOperationException("Record does not have the size of its type");
+            }
+
+            Type value;
+            std::memcpy(&value, src, sizeof(Type));
+            return value;
+        }
+    };
+
+    template<typename Char, typename Traits, typename Alloc>
+    struct serializer<std::basic_string<Char, Traits, Alloc>> {
+        using string = std::basic_string<Char, Traits, Alloc>;
+
+        static uint64_t size(const string &value) {
+            return value.size() * sizeof(Char);
+        }
+
+        static void encode(const string &value, uint8_t *dest) {
+            std::memcpy(dest, value.data(), value.size() * sizeof(Char));
+        }
+
+        static string decode(const uint8_t *src, uint64_t length) {
+            string value(length / sizeof(Char), Char{});
+            std::memcpy(value.data(), src, value.size() * sizeof(Char));
+            return value;
+        }
+    };
+
+    namespace detail {
+        // Values of fixed-size types are stored as they are; the others are prefixed with their length.
+        template<typename Type>
+        uint64_t field_size(const Type &value) {
+            if constexpr (std::is_trivially_copyable_v<Type>) {
+                return sizeof(Type);
+            } else {
+                return sizeof(uint64_t) + serializer<Type>::size(value);
+            }
+        }
+
+        template<typename Type>
+        uint8_t *encode_field(const Type &value, uint8_t *dest) {
+            if constexpr (std::is_trivially_copyable_v<Type>) {
+                std::memcpy(dest, &value, sizeof(Type));
+                return dest + sizeof(Type);
+            } else {
+                uint64_t length = serializer<Type>::size(value);
+                std::memcpy(dest, &length, sizeof(length));
+                serializer<Type>::encode(value, dest + sizeof(length));
+                return dest + sizeof(length) + length;
+            }
+        }
+
+        template<typename Type>
+        const uint8_t *decode_field(Type &value, const uint8_t *src, const uint8_t *end) {
+            uint64_t length = sizeof(Type);
+            if constexpr (!std::is_trivially_copyable_v<Type>) {
+                if ((uint64_t) (end - src) < sizeof(length)) {
+                    throw MemoryErrors::InvalidOperationException("Record is truncated");
+                }
+
+                std::memcpy(&length, src, sizeof(length));
+                src += sizeof(length);
+            }
+
+            if ((uint64_t) (end - src) < length) {
+                throw MemoryErrors::InvalidOperationException("Record is truncated");
+            }
+
+            value = serializer<Type>::decode(src, length);
+            return src + length;
+        }
+
+        template<typename Type, typename = void>
+        struct has_serialized_fields : std::false_type {};
+
+        template<typename Type>
+        struct has_serialized_fields<Type, std::void_t<decltype(Type::serialized_fields)>> : std::true_type {};
+    }
+
+    template<typename Element, typename Alloc>
+    struct serializer<std::vector<Element, Alloc>> {
+        using vector = std::vector<Element, Alloc>;
+
+        static uint64_t size(const vector &value) {
+            if constexpr (std::is_trivially_copyable_v<Element>) {
+                return value.size() * sizeof(Element);
+            } else {
+                uint64_t n = 0;
+                for (auto &element : value) {
+                    n += detail::field_size(element);
+                }
+
+                return n;
+            }
+        }
+
+        static void encode(const vector &value, uint8_t *dest) {
+            if constexpr (std::is_trivially_copyable_v<Element>) {
+                std::memcpy(dest, value.data(), value.size() * sizeof(Element));
+            } else {
+                for (auto &element : value) {
+                    dest = detail::encode_field(element, dest);
+                }
+            }
+        }
+
+        static vector decode(const uint8_t *src, uint64_t length) {
+            vector value;
+            if constexpr (std::is_trivially_copyable_v<Element>) {
+                value.resize(length / sizeof(Element));
+                std::memcpy(value.data(), src, value.size() * sizeof(Element));
+            } else {
+                auto *end = src + length;
+                while (src < end) {
+                    src = detail::decode_field(value.emplace_back(), src, end);
+                }
+            }
+
+            return value;
+        }
+    };
+
+    template<typename Type>
+    struct serializer<Type, std::enable_if_t<!std::is_trivially_copyable_v<Type> &&
+                                             detail::has_serialized_fields<Type>::value>> {
+        static uint64_t size(const Type &value) {
+            return std::apply([&value](auto... fields) {
+                return (detail::field_size(value.*fields) + ... + 0);
+            }, Type::serialized_fields);
+        }
+
+        static void encode(const Type &value, uint8_t *dest) {
+            std::apply([&value, &dest](auto... fields) {
+                ((dest = detail::encode_field(value.*fields, dest)), ...);
+            }, Type::serialized_fields);
+        }
+
+        static Type decode(const uint8_t *src, uint64_t length) {
+            Type value{};
+            auto *end = src + length;
+            std::apply([&value, &src, end](auto... fields) {
+                ((src = detail::decode_field(value.*fields, src, end)), ...);
+            }, Type::serialized_fields);
+
+            return value;
+        }
+    };
+}
+
+#endif
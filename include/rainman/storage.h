@@ -0,0 +1,271 @@
+#ifndef RAINMAN_STORAGE_H
+#define RAINMAN_STORAGE_H
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "codec.h"
+#include "freespace.h"
+
+/*
+ * Storage engines for rainman::cache. A storage owns the page file and moves pages between
+ * the file and the cache's page buffer. Memory-mapped storages expose the file directly instead.
+ */
+
+namespace rainman {
+    class storage {
+    protected:
+        uint64_t _page_size{};
+
+    public:
+        explicit storage(uint64_t page_size) : _page_size(page_size) {}
+
+        // Read the page at offset into frame. Bytes past the end of the file read as zeroes.
+        virtual void read_page(uint64_t offset, uint8_t *frame) = 0;
+
+        // Write bytes [begin, end) of the page at offset from frame.
+        virtual void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) = 0;
+
+        // Write n whole, consecutive pages starting at the page at offset. pages[i] holds the page at offset + i.
+        virtual void write_pages(uint64_t offset, const uint8_t *const *pages, uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                write_page(offset + i, pages[i], 0, _page_size);
+            }
+        }
+
+        // Make sure the page file can hold size bytes.
+        virtual void reserve(uint64_t /* size */) {}
+
+        // Give the disk space of the unused bytes [index, index + length) back to the file system. They read as
+        // zeroes afterwards. Returns false if the storage cannot.
+        virtual bool discard(uint64_t /* index */, uint64_t /* length */) {
+            return false;
+        }
+
+        // Shrink the page file to size bytes. Returns false if the storage cannot.
+        virtual bool truncate(uint64_t /* size */) {
+            return false;
+        }
+
+        // Memory-mapped storages are accessed through map() instead of a page buffer.
+        [[nodiscard]] virtual bool mapped() const {
+            return false;
+        }
+
+        // Returns a pointer to the byte at index and sets avail to the number of bytes
+        // that can be accessed contiguously from it.
+        virtual uint8_t *map(uint64_t /* index */, uint64_t &avail) {
+            avail = 0;
+            return nullptr;
+        }
+
+        // Hint that bytes [index, index + length) will be accessed soon.
+        virtual void advise(uint64_t /* index */, uint64_t /* length */) {}
+
+        // Page buffers passed to the storage must start at a multiple of this.
+        [[nodiscard]] virtual uint64_t alignment() const {
+            return 1;
+        }
+
+        // Number of page transfers the storage can serve at the same time without them competing for a device.
+        [[nodiscard]] virtual uint64_t parallelism() const {
+            return 1;
+        }
+
+        virtual void flush() = 0;
+
+        virtual ~storage() = default;
+    };
+
+    // Storage on top of a stdio FILE. Pages are moved with positional I/O on the file descriptor,
+    // so that several threads can transfer pages at the same time.
+    class stdio_storage : public storage {
+    protected:
+        FILE *_file{};
+        int _fd{};
+
+        // Size of the file. Pages past it read as zeroes without any I/O.
+        std::atomic<uint64_t> _size{};
+
+    public:
+        stdio_storage(FILE *fp, uint64_t page_size);
+
+        void read_page(uint64_t offset, uint8_t *frame) override;
+
+        void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) override;
+
+        // Writes the pages with as few pwritev calls as possible.
+        void write_pages(uint64_t offset, const uint8_t *const *pages, uint64_t n) override;
+
+        // Punches a hole in the file.
+        bool discard(uint64_t index, uint64_t length) override;
+
+        bool truncate(uint64_t size) override;
+
+        void flush() override;
+
+        ~stdio_storage() override;
+    };
+
+    // Storage that bypasses the kernel page cache with O_DIRECT, so that pages are not buffered twice. Page sizes
+    // must be a multiple of the file system's block size, and page buffers aligned to it. If the file system
+    // rejects O_DIRECT (e.g. tmpfs), pages go through the page cache like with stdio_storage.
+    class direct_storage : public stdio_storage {
+    private:
+        uint64_t _block_size{};
+        bool _direct{};
+
+    public:
+        direct_storage(FILE *fp, uint64_t page_size);
+
+        void read_page(uint64_t offset, uint8_t *frame) override;
+
+        // The written range is widened to whole blocks.
+        void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) override;
+
+        [[nodiscard]] uint64_t alignment() const override {
+            return _block_size;
+        }
+
+        // Returns false if the storage fell back to buffered I/O.
+        [[nodiscard]] bool direct() const {
+            return _direct;
+        }
+    };
+
+    // Storage that spreads pages round-robin across several files, e.g. on different disks: page p is page
+    // p / n of file p % n. The share of a run of pages that falls in each file is contiguous there, and the files
+    // are written in parallel.
+    class striped_storage : public storage {
+    private:
+        std::vector<std::unique_ptr<storage>> _stripes{};
+
+        [[nodiscard]] storage *stripe(uint64_t offset) const {
+            return _stripes[offset % _stripes.size()].get();
+        }
+
+    public:
+        // Takes ownership of files, which are accessed with direct_storage if direct is set, stdio_storage otherwise.
+        striped_storage(const std::vector<FILE *> &files, uint64_t page_size, bool direct);
+
+        void read_page(uint64_t offset, uint8_t *frame) override;
+
+        void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) override;
+
+        void write_pages(uint64_t offset, const uint8_t *const *pages, uint64_t n) override;
+
+        bool discard(uint64_t index, uint64_t length) override;
+
+        bool truncate(uint64_t size) override;
+
+        [[nodiscard]] uint64_t alignment() const override;
+
+        [[nodiscard]] uint64_t parallelism() const override {
+            return _stripes.size();
+        }
+
+        void flush() override;
+    };
+
+    // Storage that maps the page file into memory in large extents and lets the kernel page cache
+    // handle replacement. The file is grown with ftruncate as the cache grows. Extents are looked up without
+    // locking once they are mapped.
+    class mmap_storage : public storage {
+    private:
+        static constexpr uint64_t default_extent_size = 0x4000000;
+        static constexpr uint64_t extents_per_block = 0x400;
+        static constexpr uint64_t max_blocks = 0x400;
+
+        FILE *_file{};
+        int _fd{};
+        uint64_t _extent_size{};
+        uint64_t _file_size{};
+
+        // The address of every mapped extent, in blocks allocated as the file grows. Entries are only set once,
+        // with the mutex held, so map() reads them without locking.
+        std::array<std::atomic<std::atomic<uint8_t *> *>, max_blocks> _extents{};
+        std::mutex _mutex{};
+
+        void grow(uint64_t size);
+
+        // Map the extent with the given number, unless it is mapped already. Returns its address.
+        uint8_t *map_extent(uint64_t extent);
+
+    public:
+        mmap_storage(FILE *fp, uint64_t page_size);
+
+        void read_page(uint64_t offset, uint8_t *frame) override;
+
+        void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) override;
+
+        void reserve(uint64_t size) override;
+
+        [[nodiscard]] bool mapped() const override {
+            return true;
+        }
+
+        uint8_t *map(uint64_t index, uint64_t &avail) override;
+
+        void advise(uint64_t index, uint64_t length) override;
+
+        // Punches a hole in the file. The file is not truncated, since its extents stay mapped.
+        bool discard(uint64_t index, uint64_t length) override;
+
+        void flush() override;
+
+        ~mmap_storage() override;
+    };
+
+    // Storage that compresses every page with a codec. Pages are stored at variable-length slots in the file,
+    // found through an in-memory page index. A page that does not shrink is stored as-is.
+    class compressed_storage : public storage {
+    private:
+        struct page_slot {
+            uint64_t index;
+            uint64_t length;
+            uint64_t capacity;
+            bool raw;
+        };
+
+        // Slots are rounded up so that a page can usually be rewritten in place when it grows a little.
+        static constexpr uint64_t slot_granularity = 64;
+
+        FILE *_file{};
+        int _fd{};
+        std::shared_ptr<codec> _codec{};
+        std::unordered_map<uint64_t, page_slot> _slots{};
+        free_space _space{};
+        std::mutex _mutex{};
+
+        std::atomic<uint64_t> _pages_written{};
+        std::atomic<uint64_t> _pages_read{};
+        std::atomic<uint64_t> _pages_stored_raw{};
+        std::atomic<uint64_t> _bytes_in{};
+        std::atomic<uint64_t> _bytes_out{};
+        std::atomic<uint64_t> _compress_ns{};
+        std::atomic<uint64_t> _decompress_ns{};
+
+    public:
+        compressed_storage(FILE *fp, uint64_t page_size, const std::shared_ptr<codec> &page_codec);
+
+        void read_page(uint64_t offset, uint8_t *frame) override;
+
+        void write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) override;
+
+        // Drops the slots of the whole pages in the range and shrinks the file if they were at its end.
+        bool discard(uint64_t index, uint64_t length) override;
+
+        void flush() override;
+
+        compression_stats stats();
+
+        ~compressed_storage() override;
+    };
+}
+
+#endif
@@ -1,6 +1,12 @@
 #ifndef RAINMAN_TYPES_H
 #define RAINMAN_TYPES_H
 
+#include <algorithm>
+#include <compare>
+#include <iterator>
+#include <span>
+#include <type_traits>
+#include <vector>
 #include "memmgr.h"
 #include "errors.h"
 #include "cache.h"
@@ -215,56 +221,455 @@ namespace rainman {
         return ptr3d<Type>(depth, rows, cols, std::forward<Args>(args)...);
     }
 
+    /*
+     * pinned_view keeps a range of elements resident in a cache and exposes it in place, one span per page, without
+     * copying. The pages are not evicted until the view is released or destroyed. With a mutable Element, the
+     * pages are marked dirty on release, so writes through the spans must not race with other accesses to the
+     * same elements.
+     *
+     * Every pinned page holds a frame. An access that needs a frame while the calling thread's views hold all of
+     * them throws an InvalidOperationException rather than waiting for a frame that would never come free.
+     */
+    template<class Element>
+    class pinned_view {
+    private:
+        cache _cache;
+        std::vector<page_segment> _segments{};
+        bool _written{};
+
+    public:
+        pinned_view(const cache &cache, uint64_t index, uint64_t n, cache_counters *owner)
+                : _cache(cache), _written(!std::is_const_v<Element>) {
+            _cache.pin(index, sizeof(Element) * n, _segments, owner);
+
+            for (auto &segment : _segments) {
+                if (segment.length % sizeof(Element) != 0 ||
+                    reinterpret_cast<uintptr_t>(segment.data) % alignof(Element) != 0) {
+                    release();
+                    throw MemoryErrors::InvalidOperationException("Pinned elements must not straddle pages");
+                }
+            }
+        }
+
+        pinned_view(const pinned_view &) = delete;
+
+        pinned_view &operator=(const pinned_view &) = delete;
+
+        pinned_view(pinned_view &&other) noexcept
+                : _cache(other._cache), _segments(std::move(other._segments)), _written(other._written) {
+            other._segments.clear();
+        }
+
+        pinned_view &operator=(pinned_view &&rhs) noexcept {
+            if (this != &rhs) {
+                release();
+                _cache = rhs._cache;
+                _segments = std::move(rhs._segments);
+                _written = rhs._written;
+                rhs._segments.clear();
+            }
+
+            return *this;
+        }
+
+        // Returns the pinned elements, one span per page they are on.
+        [[nodiscard]] std::vector<std::span<Element>> segments() const {
+            std::vector<std::span<Element>> result;
+            result.reserve(_segments.size());
+            for (auto &segment : _segments) {
+                result.emplace_back(reinterpret_cast<Element *>(segment.data), segment.length / sizeof(Element));
+            }
+
+            return result;
+        }
+
+        // Returns the pinned elements if they are on a single page.
+        [[nodiscard]] std::span<Element> span() const {
+            if (_segments.empty()) {
+                return {};
+            }
+
+            if (_segments.size() > 1) {
+                throw MemoryErrors::InvalidOperationException("Pinned elements span several pages");
+            }
+
+            return {reinterpret_cast<Element *>(_segments[0].data), _segments[0].length / sizeof(Element)};
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            uint64_t n = 0;
+            for (auto &segment : _segments) {
+                n += segment.length / sizeof(Element);
+            }
+
+            return n;
+        }
+
+        // Unpin the pages. The spans must not be used afterwards.
+        void release() {
+            if (!_segments.empty()) {
+                _cache.unpin(_segments, _written);
+                _segments.clear();
+            }
+        }
+
+        ~pinned_view() {
+            release();
+        }
+    };
+
     /*
      * virtual_array takes a rainman::cache and maps an array to it.
      * The subscripting operator can only be used for reading purposes.
-     * For writing to an index use set().
+     * For writing to an index use set(), or at() and the iterators, which yield writable element proxies. Iterators
+     * are random-access, so the array works with generic algorithms such as std::sort.
+     *
+     * A named virtual_array is bound to its name in the cache and outlives the object. With a persistent
+     * cache it can be re-attached by name after the cache file is reopened.
+     *
+     * Every virtual_array (and its copies) counts its own hits and page I/O, which add up to the cache's stats.
+     * Its index is read through a cache_handle, so that cache::compact() can move it.
+     *
+     * push_back(), append_range() and resize() grow the array, in place when the space after it is free. Copies of
+     * an array share its size.
+     *
+     * pin() and pin_mutable() give in-place access to a range of elements through a pinned_view. The array must
+     * not be grown or compacted while a view of it is held, and a thread's views must leave a cache frame free for
+     * its other accesses.
      */
     template<class Type>
     class virtual_array : private ReferenceCounter {
     private:
+        static_assert(std::is_trivially_copyable_v<Type>,
+                      "virtual_array elements are copied byte for byte; use a record_array for other types");
+
         cache _cache;
-        uint64_t _index{};
-        uint64_t _n{};
+        cache_handle _handle{};
+
+        // Size and capacity, shared by the copies of the array so that they all see it grow.
+        struct extent {
+            uint64_t n;
+            uint64_t capacity;
+        };
+
+        std::shared_ptr<extent> _extent{};
+        std::string _name{};
+        std::shared_ptr<cache_counters> _counters{};
+
+        // Resize the allocation to capacity elements. It is extended in place if the space after it is free,
+        // and copied a large chunk at a time otherwise.
+        void reallocate(uint64_t capacity) {
+            // The cache rebinds the handle if the allocation moves.
+            _cache.reallocate<Type>(index(), capacity);
+
+            _extent->capacity = capacity;
+        }
+
     public:
+        // A proxy for an element: reads convert it to Type, assignments write through to the cache.
+        class reference {
+        private:
+            virtual_array *_array;
+            uint64_t _i;
+
+        public:
+            reference(virtual_array *array, uint64_t i) : _array(array), _i(i) {}
+
+            reference(const reference &copy) = default;
+
+            operator Type() const {
+                return (*_array)[_i];
+            }
+
+            reference &operator=(const Type &obj) {
+                _array->set(obj, _i);
+                return *this;
+            }
+
+            // Assigns the element, not the proxy.
+            reference &operator=(const reference &rhs) {
+                return *this = (Type) rhs;
+            }
+
+            friend void swap(reference a, reference b) {
+                Type tmp = a;
+                a = (Type) b;
+                b = tmp;
+            }
+        };
+
+        class iterator {
+        private:
+            virtual_array *_array{};
+            uint64_t _i{};
+
+        public:
+            using iterator_category = std::random_access_iterator_tag;
+            using value_type = Type;
+            using difference_type = int64_t;
+            using pointer = void;
+            using reference = typename virtual_array::reference;
+
+            iterator() = default;
+
+            iterator(virtual_array *array, uint64_t i) : _array(array), _i(i) {}
+
+            reference operator*() const {
+                return reference(_array, _i);
+            }
+
+            reference operator[](difference_type n) const {
+                return reference(_array, _i + n);
+            }
+
+            iterator &operator++() {
+                _i++;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                auto prev = *this;
+                _i++;
+                return prev;
+            }
+
+            iterator &operator--() {
+                _i--;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                auto prev = *this;
+                _i--;
+                return prev;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _i += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _i -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                return iterator(_array, _i + n);
+            }
+
+            friend iterator operator+(difference_type n, const iterator &iter) {
+                return iter + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                return iterator(_array, _i - n);
+            }
+
+            difference_type operator-(const iterator &rhs) const {
+                return (difference_type) _i - (difference_type) rhs._i;
+            }
+
+            bool operator==(const iterator &rhs) const {
+                return _i == rhs._i;
+            }
+
+            auto operator<=>(const iterator &rhs) const {
+                return _i <=> rhs._i;
+            }
+        };
+
         virtual_array(const cache &cache, uint64_t n) {
             this->_cache = cache;
-            _index = _cache.allocate<Type>(n);
-            _n = n;
+            _handle = _cache.handle(_cache.allocate<Type>(n));
+            _extent = std::make_shared<extent>(extent{.n=n, .capacity=n});
+            _counters = _cache.attribute();
+        }
+
+        // Attach to the array named name, creating it with n elements if it does not exist.
+        virtual_array(const cache &cache, const std::string &name, uint64_t n) {
+            this->_cache = cache;
+            uint64_t capacity;
+            _handle = _cache.handle(_cache.attach<Type>(name, n, &capacity));
+            _extent = std::make_shared<extent>(extent{.n=n, .capacity=capacity});
+            _name = name;
+            _counters = _cache.attribute();
+        }
+
+        // Attach to the existing array named name.
+        virtual_array(const cache &cache, const std::string &name) {
+            this->_cache = cache;
+            uint64_t length, capacity;
+            _handle = _cache.handle(_cache.attach(name, length, &capacity));
+            _extent = std::make_shared<extent>(extent{.n=length / sizeof(Type), .capacity=capacity / sizeof(Type)});
+            _name = name;
+            _counters = _cache.attribute();
         }
 
         virtual_array(const virtual_array &copy) : ReferenceCounter(copy) {
             _cache = copy._cache;
-            _index = copy._index;
-            _n = copy._n;
+            _handle = copy._handle;
+            _extent = copy._extent;
+            _name = copy._name;
+            _counters = copy._counters;
         }
 
         virtual_array &operator=(const virtual_array &rhs) {
             if (this != &rhs) {
                 ReferenceCounter::copy(*this, rhs, true);
                 _cache = rhs._cache;
-                _index = rhs._index;
-                _n = rhs._n;
+                _handle = rhs._handle;
+                _extent = rhs._extent;
+                _name = rhs._name;
+                _counters = rhs._counters;
             }
 
             return *this;
         }
 
         Type operator[](uint64_t i) {
-            return _cache.read<Type>(_index + sizeof(Type) * i);
+            return _cache.read<Type>(index() + sizeof(Type) * i, _counters.get());
         }
 
         void set(Type obj, uint64_t i) {
-            _cache.write(obj, _index + sizeof(Type) * i);
+            _cache.write(obj, index() + sizeof(Type) * i, _counters.get());
+        }
+
+        // Copy n elements starting at index i into dest.
+        void get_range(Type *dest, uint64_t i, uint64_t n) {
+            if (i + n > size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            _cache.read_range(dest, index() + sizeof(Type) * i, sizeof(Type) * n, _counters.get());
+        }
+
+        // Hint that elements [begin, end) will be read soon, so that the cache loads them in the background.
+        void prefetch(uint64_t begin, uint64_t end) {
+            if (begin >= end) {
+                return;
+            }
+
+            _cache.prefetch(index() + sizeof(Type) * begin, sizeof(Type) * (std::min(end, size()) - begin));
+        }
+
+        // Copy n elements from src into the array starting at index i.
+        void set_range(const Type *src, uint64_t i, uint64_t n) {
+            if (i + n > size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            _cache.write_range(src, index() + sizeof(Type) * i, sizeof(Type) * n, _counters.get());
+        }
+
+        // Pin elements [begin, begin + n) in the cache and return a read-only view of them in place.
+        pinned_view<const Type> pin(uint64_t begin, uint64_t n) {
+            if (begin + n > size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            return pinned_view<const Type>(_cache, index() + sizeof(Type) * begin, n, _counters.get());
+        }
+
+        // Pin elements [begin, begin + n) and return a writable view of them, whose pages are marked dirty when it
+        // is released.
+        pinned_view<Type> pin_mutable(uint64_t begin, uint64_t n) {
+            if (begin + n > size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            return pinned_view<Type>(_cache, index() + sizeof(Type) * begin, n, _counters.get());
+        }
+
+        // Returns a writable proxy for the element at index i.
+        reference at(uint64_t i) {
+            if (i >= size()) {
+                throw MemoryErrors::SegmentationFaultException();
+            }
+
+            return reference(this, i);
+        }
+
+        // Element accesses through iterators take the cache's per-thread frame hint, so stepping through a
+        // resident page never looks up the page table.
+        iterator begin() {
+            return iterator(this, 0);
+        }
+
+        iterator end() {
+            return iterator(this, size());
         }
 
         [[nodiscard]] uint64_t size() const {
-            return _n;
+            return _extent->n;
+        }
+
+        [[nodiscard]] uint64_t capacity() const {
+            return _extent->capacity;
+        }
+
+        // Make room for at least capacity elements without changing the size.
+        void reserve(uint64_t capacity) {
+            if (capacity > _extent->capacity) {
+                reallocate(capacity);
+            }
+        }
+
+        // Change the number of elements. New elements have unspecified values. The capacity grows geometrically.
+        // A named array records its size in the cache, so that it is re-attached with it.
+        void resize(uint64_t n) {
+            if (n > _extent->capacity) {
+                reallocate(std::max(n, 2 * _extent->capacity));
+            }
+
+            if (!_name.empty() && n != _extent->n) {
+                _cache.set_length(_name, n * sizeof(Type));
+            }
+
+            _extent->n = n;
+        }
+
+        void push_back(const Type &obj) {
+            resize(size() + 1);
+            set(obj, size() - 1);
+        }
+
+        // Append n elements from src.
+        void append_range(const Type *src, uint64_t n) {
+            auto begin = size();
+            resize(begin + n);
+            set_range(src, begin, n);
+        }
+
+        // Give the capacity beyond the size back to the cache.
+        void shrink_to_fit() {
+            if (_extent->n < _extent->capacity) {
+                reallocate(_extent->n);
+            }
+        }
+
+        // Returns the cache the array is stored in.
+        [[nodiscard]] const cache &parent() const {
+            return _cache;
+        }
+
+        // Returns the byte-index of the array in the cache, which changes when the cache is compacted.
+        [[nodiscard]] uint64_t index() const {
+            return _handle->load(std::memory_order_relaxed);
+        }
+
+        // Returns the accesses and page I/O of this array since it was created or last reset.
+        [[nodiscard]] cache_stats stats() const {
+            return _counters->snapshot();
+        }
+
+        void reset_stats() {
+            _cache.reset_stats(_counters.get());
         }
 
         ~virtual_array() {
-            if (!refs()) {
-                _cache.deallocate(_index);
+            if (!refs() && _name.empty()) {
+                _cache.deallocate(index());
             }
         }
     };
@@ -87,6 +87,11 @@ namespace rainman {
             return _rainman_mgr->r_malloc<Type>(n);
         }
 
+        template<typename Type>
+        inline Type *rmalloc_aligned(uint64_t n, uint64_t alignment) {
+            return _rainman_mgr->r_malloc_aligned<Type>(n, alignment);
+        }
+
         template<typename Type, typename ...Args>
         inline Type *rnew(uint64_t n_elems, Args ...args) {
             return _rainman_mgr->r_new<Type>(n_elems, std::forward<Args>(args)...);
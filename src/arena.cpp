@@ -0,0 +1,37 @@
+#include <algorithm>
+#include "rainman/arena.h"
+
+rainman::page_arena::page_arena(const cache &cache, uint64_t segment_pages)
+        : _cache(cache), _segment_pages(std::max<uint64_t>(segment_pages, 1)) {
+    _page = _cache.page_size();
+}
+
+uint64_t rainman::page_arena::allocate() {
+    if (_spare.empty()) {
+        auto index = _cache.allocate<uint8_t>((_segment_pages + 1) * _page);
+        _allocations.push_back(index);
+
+        // Hand out the segment's pages in address order.
+        auto first = (index + _page - 1) / _page * _page;
+        for (uint64_t i = _segment_pages; i > 0; i--) {
+            _spare.push_back(first + (i - 1) * _page);
+        }
+    }
+
+    auto index = _spare.back();
+    _spare.pop_back();
+    _used++;
+
+    return index;
+}
+
+void rainman::page_arena::release(uint64_t index) {
+    _spare.push_back(index);
+    _used--;
+}
+
+rainman::page_arena::~page_arena() {
+    for (auto index : _allocations) {
+        _cache.deallocate(index);
+    }
+}
@@ -1,68 +1,1559 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <exception>
 #include "rainman/cache.h"
 
-rainman::cache::_icache::_icache(FILE *fp, uint64_t size, const Allocator &allocator) : _allocator(allocator) {
-    page_file = fp;
-    page_size = size;
-    page = _allocator.rmalloc<uint8_t>(size);
+namespace {
+    constexpr char header_magic[8] = {'R', 'A', 'I', 'N', 'M', 'A', 'N', '\0'};
+    constexpr uint32_t header_version = 2;
+
+    // The header occupies the first bytes of a persistent page file. Allocations start after it.
+    constexpr uint64_t header_size = 0x1000;
+
+    struct cache_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t page_size;
+        uint64_t eof;
+        uint64_t catalog_index;
+        uint64_t catalog_length;
+    };
+
+    void put_u64(std::vector<uint8_t> &buffer, uint64_t value) {
+        auto *bytes = reinterpret_cast<uint8_t *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(uint64_t));
+    }
+
+    uint64_t get_u64(const std::vector<uint8_t> &buffer, uint64_t &pos) {
+        if (pos + sizeof(uint64_t) > buffer.size()) {
+            throw MemoryErrors::IOException("Corrupt cache catalog");
+        }
+
+        uint64_t value;
+        std::memcpy(&value, buffer.data() + pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+
+        return value;
+    }
 }
 
-uint8_t rainman::cache::_icache::get_byte(uint64_t index) {
-    auto offset = index / page_size;
-    auto page_index = index % page_size;
-    if (offset == page_offset) {
-        return page[page_index];
-    } else {
-        // Swap page
-        std::fseek(page_file, page_offset * page_size, SEEK_SET);
-        std::fwrite(page, 1, page_size, page_file);
+namespace {
+    // Every cache gets a unique id, so that a thread's frame hint can never refer to a destroyed cache.
+    std::atomic<uint64_t> cache_ids{};
+
+    // The frame a thread accessed last, which is tried before the page table.
+    struct frame_hint {
+        uint64_t cache_id = UINT64_MAX;
+        uint64_t offset{};
+        void *frame{};
+    };
+
+    thread_local frame_hint hint;
+
+    // The pins each cache's pin_range has handed to this thread and that are not unpinned yet, by cache id.
+    thread_local std::unordered_map<uint64_t, uint64_t> held_pins;
+
+    using counter = std::atomic<uint64_t> rainman::cache_counters::*;
 
-        std::fseek(page_file, offset * page_size, SEEK_SET);
-        std::fread(page, 1, page_size, page_file);
-        page_offset = offset;
-        return page[page_index];
+    constexpr std::pair<counter, uint64_t rainman::cache_stats::*> counter_fields[] = {
+            {&rainman::cache_counters::hits,          &rainman::cache_stats::hits},
+            {&rainman::cache_counters::misses,        &rainman::cache_stats::misses},
+            {&rainman::cache_counters::evictions,     &rainman::cache_stats::evictions},
+            {&rainman::cache_counters::write_backs,   &rainman::cache_stats::write_backs},
+            {&rainman::cache_counters::prefetches,    &rainman::cache_stats::prefetches},
+            {&rainman::cache_counters::bytes_read,    &rainman::cache_stats::bytes_read},
+            {&rainman::cache_counters::bytes_written, &rainman::cache_stats::bytes_written},
+            {&rainman::cache_counters::io_wait_ns,    &rainman::cache_stats::io_wait_ns},
+            {&rainman::cache_counters::bytes_reclaimed, &rainman::cache_stats::bytes_reclaimed},
+    };
+
+    // Bump a counter of the virtual_array the access is made for, if any, otherwise of the cache.
+    inline void count(rainman::cache_counters &counters, rainman::cache_counters *owner, counter field,
+                      uint64_t n = 1) {
+        auto *target = owner != nullptr ? owner : &counters;
+        (target->*field).fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Move the counts of from into to.
+    void fold(rainman::cache_counters &from, rainman::cache_counters &to) {
+        for (auto [field, _] : counter_fields) {
+            (to.*field).fetch_add((from.*field).exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    // Scratch space for writing back a run of pages, aligned for storages that need it.
+    struct run_buffer {
+        uint8_t *data;
+        std::align_val_t alignment;
+
+        run_buffer(uint64_t size, uint64_t alignment) : alignment(std::align_val_t(alignment)) {
+            data = static_cast<uint8_t *>(operator new[](size, this->alignment));
+        }
+
+        ~run_buffer() {
+            operator delete[](data, alignment);
+        }
+    };
+
+    uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
     }
 }
 
-void rainman::cache::_icache::set_byte(uint8_t byte, uint64_t index) {
-    auto offset = index / page_size;
-    auto page_index = index % page_size;
-    if (offset == page_offset) {
-        page[page_index] = byte;
-    } else {
-        // Swap page
-        std::fseek(page_file, page_offset * page_size, SEEK_SET);
-        std::fwrite(page, 1, page_size, page_file);
+rainman::cache_stats rainman::cache_counters::snapshot() const {
+    cache_stats result{};
+    for (auto [field, stat] : counter_fields) {
+        result.*stat = (this->*field).load(std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+void rainman::cache_counters::reset() {
+    for (auto [field, _] : counter_fields) {
+        (this->*field).store(0, std::memory_order_relaxed);
+    }
+}
+
+static FILE *open_page_file(const std::string &filename) {
+    auto fp = std::fopen(filename.c_str(), "rb+");
+    if (fp == nullptr) {
+        fp = std::fopen(filename.c_str(), "wb+");
+    }
 
-        std::fseek(page_file, offset * page_size, SEEK_SET);
-        std::fread(page, 1, page_size, page_file);
-        page_offset = offset;
-        page[page_index] = byte;
+    if (fp == nullptr) {
+        throw MemoryErrors::IOException("Failed to open page file: " + filename);
     }
+
+    return fp;
 }
 
-rainman::cache::_icache::_icache(const std::string &filename, uint64_t size, const rainman::Allocator &allocator) {
+static FILE *create_page_file(const std::string &filename) {
     std::remove(filename.c_str());
     auto tmp = std::fopen(filename.c_str(), "a");
+    if (tmp == nullptr) {
+        throw MemoryErrors::IOException("Failed to create page file: " + filename);
+    }
     std::fclose(tmp);
 
-    page_file = std::fopen(filename.c_str(), "rb+");
+    return std::fopen(filename.c_str(), "rb+");
+}
+
+rainman::cache::_icache::_icache(FILE *fp, uint64_t size, const cache_options &options, const Allocator &allocator)
+        : _allocator(allocator) {
     page_size = size;
-    page = _allocator.rmalloc<uint8_t>(size);
+    id = cache_ids++;
+
+    if (options.compression != nullptr && (options.backend != cache_backend::stdio || options.persistent)) {
+        std::fclose(fp);
+        throw MemoryErrors::InvalidOperationException("Only stdio, non-persistent caches can be compressed");
+    }
+
+    if (!options.stripes.empty() && (options.backend == cache_backend::mmap || options.compression != nullptr)) {
+        std::fclose(fp);
+        throw MemoryErrors::InvalidOperationException("Only uncompressed stdio and direct caches can be striped");
+    }
+
+    // A pooled cache has joined the pool and taken frames by the time the catalog is read, so both are given back
+    // if opening fails.
+    try {
+        open_storage(fp, options);
+    } catch (...) {
+        release_frames();
+        throw;
+    }
+
+    if (options.dirty_ratio > 0 && !_storage->mapped()) {
+        dirty_limit = std::max<uint64_t>(1, (uint64_t) (options.dirty_ratio * (double) max_frames));
+        flusher = std::thread(&_icache::flush_loop, this);
+    }
+}
+
+void rainman::cache::_icache::open_storage(FILE *fp, const cache_options &options) {
+    auto size = page_size;
+
+    switch (options.backend) {
+        case cache_backend::mmap:
+            _storage = _allocator.rnew<mmap_storage>(1, fp, size);
+            break;
+        default:
+            if (!options.stripes.empty()) {
+                std::vector<FILE *> files{fp};
+                try {
+                    for (auto &filename : options.stripes) {
+                        files.push_back(options.persistent ? open_page_file(filename) : create_page_file(filename));
+                    }
+                } catch (...) {
+                    for (auto *file : files) {
+                        std::fclose(file);
+                    }
+                    throw;
+                }
+
+                _storage = _allocator.rnew<striped_storage>(1, files, size, options.backend == cache_backend::direct);
+            } else if (options.backend == cache_backend::direct) {
+                _storage = _allocator.rnew<direct_storage>(1, fp, size);
+            } else if (options.compression != nullptr) {
+                _storage = _allocator.rnew<compressed_storage>(1, fp, size, options.compression);
+            } else {
+                _storage = _allocator.rnew<stdio_storage>(1, fp, size);
+            }
+            read_ahead = options.read_ahead;
+            max_frames = std::max(options.frames, read_ahead + 1);
+
+            if (options.pool._inner != nullptr) {
+                // Frames come from the pool on demand; max_frames only bounds explicit prefetches.
+                pool = options.pool;
+                pool._inner->join(this);
+                max_frames = std::max(pool._inner->stats().budget / size, read_ahead + 1);
+            } else if (options.memory_budget != 0) {
+                max_frames = std::max(options.memory_budget / size, read_ahead + 1);
+            } else {
+                for (uint64_t i = 0; i < max_frames; i++) {
+                    grow();
+                }
+            }
+            break;
+    }
+
+    if (options.persistent) {
+        persistent = true;
+        load_catalog();
+    }
+}
+
+uint64_t rainman::cache::_icache::find_space(uint64_t size) {
+    auto index = space.allocate(footprint(size));
+    _storage->reserve(space.end());
+    lenmap[index] = size;
+
+    return index;
+}
+
+void rainman::cache::_icache::release_space(uint64_t index) {
+    auto iter = lenmap.find(index);
+    if (iter == lenmap.end()) {
+        return;
+    }
+
+    auto length = iter->second;
+    lenmap.erase(iter);
+    handles.erase(index);
+
+    free_range(index, footprint(length));
+}
+
+uint64_t rainman::cache::_icache::free_range(uint64_t index, uint64_t length) {
+    auto end = space.end();
+    auto merged = space.release(index, length);
+    if (length == 0) {
+        return 0;
+    }
+
+    // The whole pages of the merged free region, or of everything past the new end of the file if it shrank.
+    bool trimmed = space.end() < end;
+    auto begin = (merged.index + page_size - 1) / page_size * page_size;
+    auto limit = trimmed ? (end + page_size - 1) / page_size * page_size
+                         : (merged.index + merged.length) / page_size * page_size;
+
+    if (trimmed) {
+        // Pages past the new size are then discarded for free.
+        _storage->truncate(std::max(space.end(), catalog_end));
+    }
+
+    uint64_t reclaimed = 0;
+    auto give_back = [&](uint64_t first, uint64_t last) {
+        if (first >= last) {
+            return;
+        }
+
+        if (!_storage->mapped()) {
+            drop_pages(first / page_size, last / page_size);
+        }
+
+        if (_storage->discard(first, last - first)) {
+            auto overlap_begin = std::max(first, index);
+            auto overlap_end = std::min(last, index + length);
+            reclaimed += overlap_end > overlap_begin ? overlap_end - overlap_begin : 0;
+        }
+    };
+
+    // Keep the pages of the catalog the header of a persistent cache points to.
+    if (catalog_end > catalog_begin) {
+        give_back(begin, std::min(limit, catalog_begin / page_size * page_size));
+        give_back(std::max(begin, (catalog_end + page_size - 1) / page_size * page_size), limit);
+    } else {
+        give_back(begin, limit);
+    }
+
+    count(counters, nullptr, &cache_counters::bytes_reclaimed, reclaimed);
+    return reclaimed;
+}
+
+void rainman::cache::_icache::drop_pages(uint64_t first, uint64_t last) {
+    std::unique_lock<std::shared_mutex> lock(table_latch);
+
+    bool dropped = false;
+    for (auto *frame : frames) {
+        if (!frame->valid || frame->loading || frame->offset < first || frame->offset >= last || !claim(frame)) {
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> frame_lock(frame->latch);
+            if (frame->dirty) {
+                frame->dirty = false;
+                n_dirty--;
+            }
+        }
+
+        page_table.erase(frame->offset);
+        frame->valid = false;
+        frame->referenced = false;
+        frame->loading = false;
+        dropped = true;
+    }
+
+    if (dropped && frame_waiters > 0) {
+        frame_cv.notify_all();
+    }
+}
+
+uint64_t rainman::cache::_icache::allocate_bytes(uint64_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return find_space(size);
+}
+
+void rainman::cache::_icache::deallocate(uint64_t index) {
+    std::unique_lock<std::mutex> lock(mutex);
+    release_space(index);
+}
+
+uint64_t rainman::cache::_icache::attach(const std::string &name, uint64_t size, bool create, uint64_t &length,
+                                         uint64_t &capacity) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto iter = names.find(name);
+    if (iter != names.end()) {
+        capacity = lenmap[iter->second];
+        length = std::min(name_lengths[name], capacity);
+        return iter->second;
+    }
+
+    if (!create) {
+        throw MemoryErrors::InvalidOperationException("No allocation named " + name);
+    }
+
+    auto index = find_space(size);
+    names[name] = index;
+    name_lengths[name] = size;
+    length = size;
+    capacity = size;
+
+    return index;
+}
+
+void rainman::cache::_icache::set_length(const std::string &name, uint64_t length) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto iter = names.find(name);
+    if (iter == names.end()) {
+        throw MemoryErrors::InvalidOperationException("No allocation named " + name);
+    }
+
+    if (length > lenmap[iter->second]) {
+        throw MemoryErrors::InvalidOperationException("Length exceeds the allocation named " + name);
+    }
+
+    name_lengths[name] = length;
+}
+
+void rainman::cache::_icache::release(const std::string &name) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto iter = names.find(name);
+    if (iter == names.end()) {
+        throw MemoryErrors::InvalidOperationException("No allocation named " + name);
+    }
+
+    release_space(iter->second);
+    name_lengths.erase(name);
+    names.erase(iter);
+}
+
+bool rainman::cache::_icache::contains(const std::string &name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return names.contains(name);
+}
+
+uint64_t rainman::cache::_icache::reallocate_bytes(uint64_t index, uint64_t size) {
+    // Relocation must not race with compaction moving the same allocation.
+    std::unique_lock<std::mutex> compaction_lock(compacting);
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto iter = lenmap.find(index);
+    if (iter == lenmap.end()) {
+        throw MemoryErrors::InvalidOperationException("No allocation at index " + std::to_string(index));
+    }
+
+    auto length = iter->second;
+    if (size <= length) {
+        iter->second = size;
+        free_range(index + footprint(size), footprint(length) - footprint(size));
+        return index;
+    }
+
+    // Grow in place at the end of the file or into free space right after the allocation.
+    if (space.extend(index + footprint(length), size - footprint(length))) {
+        iter->second = size;
+        _storage->reserve(space.end());
+        return index;
+    }
+
+    auto target = find_space(size);
+    lock.unlock();
+
+    try {
+        copy_range(index, target, length);
+    } catch (...) {
+        lock.lock();
+        release_space(target);
+        throw;
+    }
+
+    lock.lock();
+    lenmap.erase(index);
+    rebind(index, target);
+    free_range(index, footprint(length));
+
+    return target;
+}
+
+void rainman::cache::_icache::copy_range(uint64_t from, uint64_t to, uint64_t length) {
+    std::vector<uint8_t> buffer(std::min(length, max_write_run));
+
+    for (uint64_t pos = 0; pos < length; pos += buffer.size()) {
+        auto n = std::min<uint64_t>(buffer.size(), length - pos);
+        read_range(buffer.data(), from + pos, n);
+        write_range(buffer.data(), to + pos, n);
+    }
+}
+
+void rainman::cache::_icache::rebind(uint64_t from, uint64_t to) {
+    auto iter = handles.find(from);
+    if (iter != handles.end()) {
+        auto location = iter->second;
+        handles.erase(iter);
+        handles[to] = location;
+        location->store(to);
+    }
+
+    for (auto &[name, index] : names) {
+        if (index == from) {
+            index = to;
+        }
+    }
+}
+
+rainman::cache_handle rainman::cache::_icache::handle(uint64_t index) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto iter = handles.find(index);
+    if (iter != handles.end()) {
+        return iter->second;
+    }
+
+    auto location = std::make_shared<std::atomic<uint64_t>>(index);
+    if (lenmap.contains(index)) {
+        handles[index] = location;
+    }
+
+    return location;
+}
+
+rainman::compaction_stats rainman::cache::_icache::compact(
+        const std::function<void(const compaction_stats &)> &progress) {
+    std::unique_lock<std::mutex> compaction_lock(compacting);
+
+    struct candidate {
+        uint64_t index;
+        uint64_t length;
+        std::shared_ptr<std::atomic<uint64_t>> location;
+    };
+
+    compaction_stats result{};
+    std::vector<candidate> candidates;
+
+    mutex.lock();
+    result.file_size_before = space.end();
+    for (auto &[index, location] : handles) {
+        auto length = lenmap[index];
+        candidates.push_back(candidate{.index=index, .length=length, .location=location});
+        result.allocations++;
+        result.bytes += length;
+    }
+    mutex.unlock();
+
+    // The allocations furthest from the start go first, into the lowest free space they fit in, so that the free
+    // space gathers at the end of the file, where it is trimmed off.
+    std::sort(candidates.begin(), candidates.end(), [](auto &a, auto &b) { return a.index > b.index; });
+
+    for (auto &allocation : candidates) {
+        mutex.lock();
+        auto iter = handles.find(allocation.index);
+        auto target = iter != handles.end() && iter->second == allocation.location
+                      ? space.allocate_below(footprint(allocation.length), allocation.index) : free_space::npos;
+        mutex.unlock();
+
+        if (target == free_space::npos) {
+            continue;
+        }
+
+        copy_range(allocation.index, target, allocation.length);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        iter = handles.find(allocation.index);
+        if (iter == handles.end() || iter->second != allocation.location) {
+            // Deallocated meanwhile.
+            result.bytes_reclaimed += free_range(target, footprint(allocation.length));
+            continue;
+        }
+
+        lenmap.erase(allocation.index);
+        lenmap[target] = allocation.length;
+        rebind(allocation.index, target);
+
+        result.bytes_reclaimed += free_range(allocation.index, footprint(allocation.length));
+        result.allocations_moved++;
+        result.bytes_moved += allocation.length;
+        result.file_size_after = space.end();
+        lock.unlock();
+
+        if (progress) {
+            progress(result);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    result.file_size_after = space.end();
+
+    return result;
+}
+
+void rainman::cache::_icache::load_catalog() {
+    cache_header header{};
+    read_range(reinterpret_cast<uint8_t *>(&header), 0, sizeof(cache_header));
+
+    if (std::memcmp(header.magic, header_magic, sizeof(header_magic)) != 0) {
+        // A new (or empty) page file: keep the header out of the way of allocations.
+        const cache_header empty{};
+        if (std::memcmp(&header, &empty, sizeof(cache_header)) != 0) {
+            throw MemoryErrors::IOException("Not a rainman cache file");
+        }
+
+        space.end(header_size);
+        _storage->reserve(header_size);
+        return;
+    }
+
+    // Version 1 catalogs have no lengths for named allocations, which then hold exactly their data.
+    if (header.version != header_version && header.version != 1) {
+        throw MemoryErrors::IOException("Unsupported cache file version");
+    }
+
+    if (header.page_size != page_size) {
+        throw MemoryErrors::IOException("Cache file has a page size of " + std::to_string(header.page_size));
+    }
+
+    std::vector<uint8_t> catalog(header.catalog_length);
+    read_range(catalog.data(), header.catalog_index, header.catalog_length);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    space.end(header.eof);
+    catalog_begin = header.catalog_index;
+    catalog_end = header.catalog_index + header.catalog_length;
+
+    uint64_t pos = 0;
+    auto n_regions = get_u64(catalog, pos);
+    for (uint64_t i = 0; i < n_regions; i++) {
+        auto index = get_u64(catalog, pos);
+        auto length = get_u64(catalog, pos);
+        space.restore(index, length);
+    }
+
+    auto n_allocations = get_u64(catalog, pos);
+    for (uint64_t i = 0; i < n_allocations; i++) {
+        auto index = get_u64(catalog, pos);
+        lenmap[index] = get_u64(catalog, pos);
+    }
+
+    auto n_names = get_u64(catalog, pos);
+    for (uint64_t i = 0; i < n_names; i++) {
+        auto name_length = get_u64(catalog, pos);
+        if (pos + name_length > catalog.size()) {
+            throw MemoryErrors::IOException("Corrupt cache catalog");
+        }
+
+        auto name = std::string(reinterpret_cast<const char *>(catalog.data() + pos), name_length);
+        pos += name_length;
+        auto index = get_u64(catalog, pos);
+        names[name] = index;
+        name_lengths[name] = header.version > 1 ? get_u64(catalog, pos) : lenmap[index];
+    }
+}
+
+void rainman::cache::_icache::save_catalog() {
+    std::vector<uint8_t> catalog;
+    cache_header header{};
+
+    mutex.lock();
+
+    auto regions = space.regions();
+    put_u64(catalog, regions.size());
+    for (auto &region : regions) {
+        put_u64(catalog, region.index);
+        put_u64(catalog, region.length);
+    }
+
+    put_u64(catalog, lenmap.size());
+    for (auto &[index, length] : lenmap) {
+        put_u64(catalog, index);
+        put_u64(catalog, length);
+    }
+
+    put_u64(catalog, names.size());
+    for (auto &[name, index] : names) {
+        put_u64(catalog, name.size());
+        catalog.insert(catalog.end(), name.begin(), name.end());
+        put_u64(catalog, index);
+        put_u64(catalog, name_lengths[name]);
+    }
+
+    // The catalog is stored right after the last allocation. It is rewritten on every save,
+    // so allocations made after a reopen are free to overwrite it.
+    std::memcpy(header.magic, header_magic, sizeof(header_magic));
+    header.version = header_version;
+    header.page_size = page_size;
+    header.eof = space.end();
+    header.catalog_index = space.end();
+    header.catalog_length = catalog.size();
+    catalog_begin = header.catalog_index;
+    catalog_end = header.catalog_index + header.catalog_length;
+
+    mutex.unlock();
+
+    write_range(catalog.data(), header.catalog_index, header.catalog_length);
+    write_range(reinterpret_cast<const uint8_t *>(&header), 0, sizeof(cache_header));
+}
+
+void rainman::cache::_icache::write_back(page_frame &frame, cache_counters *owner) {
+    if (!frame.dirty) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    _storage->write_page(frame.offset, frame.data, frame.dirty_begin, frame.dirty_end);
+    frame.dirty = false;
+    n_dirty--;
+
+    count(counters, owner, &cache_counters::write_backs);
+    count(counters, owner, &cache_counters::bytes_written, frame.dirty_end - frame.dirty_begin);
+    count(counters, owner, &cache_counters::io_wait_ns, elapsed_ns(start));
+}
+
+rainman::page_frame *rainman::cache::_icache::grow() {
+    if (pool._inner == nullptr && frames.size() >= max_frames) {
+        return nullptr;
+    }
+
+    page_frame *frame = nullptr;
+    try {
+        if (pool._inner != nullptr) {
+            frame = pool._inner->acquire(this, page_size, _storage->alignment());
+            if (frame == nullptr) {
+                return nullptr;
+            }
+        } else {
+            frame = _allocator.rnew<page_frame>(1);
+            auto alignment = _storage->alignment();
+            frame->data = alignment > 1 ? _allocator.rmalloc_aligned<uint8_t>(page_size, alignment)
+                                        : _allocator.rmalloc<uint8_t>(page_size);
+        }
+    } catch (MemoryErrors::PeakLimitReachedException &) {
+        // The Allocator is full: stop growing and spill pages instead, unless there is nothing to spill.
+        if (pool._inner == nullptr) {
+            _allocator.rfree(frame);
+        }
+
+        if (frames.empty()) {
+            throw;
+        }
+
+        max_frames = frames.size();
+        return nullptr;
+    }
+
+    frame->owner = id;
+    frames.push_back(frame);
+    return frame;
+}
+
+rainman::page_frame *rainman::cache::_icache::sweep(bool clean_only) {
+    // Clock sweep: a referenced frame gets a second chance, so the coldest pages are spilled first.
+    auto n_frames = frames.size();
+    for (uint64_t i = 0; i < 2 * n_frames; i++) {
+        auto *frame = frames[clock_hand];
+        clock_hand = (clock_hand + 1) % n_frames;
+
+        if (frame->pins > 0 || frame->loading || (clean_only && frame->dirty)) {
+            continue;
+        }
+
+        if (frame->referenced.exchange(false, std::memory_order_relaxed)) {
+            continue;
+        }
+
+        return frame;
+    }
+
+    return nullptr;
+}
+
+rainman::page_frame *rainman::cache::_icache::find_victim(bool clean_only) {
+    auto *frame = grow();
+    if (frame != nullptr) {
+        return frame;
+    }
+
+    // With a background writer, a page that is already written back is spilled before one that would have to be.
+    if (dirty_limit != 0 && !clean_only) {
+        frame = sweep(true);
+        if (frame != nullptr) {
+            return frame;
+        }
+    }
+
+    return sweep(clean_only);
+}
+
+rainman::page_frame *rainman::cache::_icache::surrender() {
+    // Called by the pool on behalf of another cache, which may hold its own page table latch: never block.
+    std::unique_lock<std::shared_mutex> lock(table_latch, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return nullptr;
+    }
+
+    auto *frame = sweep(false);
+    if (frame == nullptr || !claim(frame)) {
+        return nullptr;
+    }
+
+    // Unlike eviction, this writes back with the page table latch held, since it could not be retaken without
+    // blocking. The frame is claimed, so no one can write to it meanwhile.
+    try {
+        write_back(*frame);
+    } catch (...) {
+        frame->loading = false;
+        return nullptr;
+    }
+
+    if (frame->valid) {
+        page_table.erase(frame->offset);
+        count(counters, nullptr, &cache_counters::evictions);
+    }
+
+    std::erase(frames, frame);
+    clock_hand = frames.empty() ? 0 : clock_hand % frames.size();
+
+    // A thread that still has the frame as its hint sees it is no longer valid (or ours) once loading is cleared.
+    frame->valid = false;
+    frame->owner = npos;
+    frame->referenced = false;
+    frame->loading = false;
+
+    return frame;
+}
+
+bool rainman::cache::_icache::claim(page_frame *frame) {
+    // Pairs with the optimistic pin: either the pinning thread sees the frame as loading, or this sees the pin.
+    frame->loading = true;
+    if (frame->pins > 0) {
+        frame->loading = false;
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t rainman::cache::_icache::frame_limit() {
+    if (_storage->mapped()) {
+        return UINT64_MAX;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(table_latch);
+    return max_frames;
+}
+
+bool rainman::cache::_icache::pinned_by_caller() {
+    auto iter = held_pins.find(id);
+    if (iter == held_pins.end() || iter->second == 0) {
+        return false;
+    }
+
+    uint64_t pins = 0;
+    for (auto *frame : frames) {
+        if (frame->loading) {
+            return false;
+        }
+
+        pins += frame->pins;
+    }
+
+    return pins <= iter->second;
+}
+
+rainman::page_frame *rainman::cache::_icache::pin(uint64_t offset, cache_counters *owner) {
+    // Optimistically pin the frame this thread used last, then check that it still holds the page.
+    if (hint.cache_id == id && hint.offset == offset) {
+        auto *frame = static_cast<page_frame *>(hint.frame);
+        frame->pins++;
+        if (!frame->loading && frame->valid && frame->offset == offset && frame->owner == id) {
+            if (!frame->referenced.load(std::memory_order_relaxed)) {
+                frame->referenced.store(true, std::memory_order_relaxed);
+            }
+            count(counters, owner, &cache_counters::hits);
+            return frame;
+        }
+
+        unpin(frame);
+    }
+
+    // Hits only take the page table latch in shared mode, so readers of resident pages never block each other.
+    {
+        std::shared_lock<std::shared_mutex> lock(table_latch);
+        auto iter = page_table.find(offset);
+        if (iter != page_table.end() && !iter->second->loading) {
+            auto *frame = iter->second;
+            frame->pins++;
+            frame->referenced = true;
+            hint = frame_hint{.cache_id=id, .offset=offset, .frame=frame};
+            count(counters, owner, &cache_counters::hits);
+            return frame;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(table_latch);
+
+    while (true) {
+        auto iter = page_table.find(offset);
+        if (iter != page_table.end()) {
+            auto *frame = iter->second;
+            if (frame->loading) {
+                frame_cv.wait(lock);
+                continue;
+            }
+
+            frame->pins++;
+            frame->referenced = true;
+            hint = frame_hint{.cache_id=id, .offset=offset, .frame=frame};
+            count(counters, owner, &cache_counters::hits);
+            return frame;
+        }
+
+        // Count as a waiter before looking for a frame, so that a frame unpinned during the search is notified.
+        frame_waiters++;
+        page_frame *frame;
+        try {
+            frame = find_victim(false);
+        } catch (...) {
+            frame_waiters--;
+            throw;
+        }
+
+        if (frame == nullptr) {
+            // Every frame is pinned or busy. No frame would ever come free if this thread holds all the pins.
+            if (pinned_by_caller()) {
+                frame_waiters--;
+                throw MemoryErrors::InvalidOperationException("Every cache frame is pinned by this thread");
+            }
+
+            frame_cv.wait(lock);
+            frame_waiters--;
+            continue;
+        }
+
+        frame_waiters--;
+
+        if (!claim(frame)) {
+            continue;
+        }
+
+        if (frame->valid && frame->dirty) {
+            // Write the victim back while it stays mapped to its old page. Accesses to that page wait until
+            // the page file has the data, then the lookup starts over, with the clock back on this frame.
+            clock_hand = (clock_hand + frames.size() - 1) % frames.size();
+            lock.unlock();
+
+            try {
+                write_back(*frame, owner);
+            } catch (...) {
+                lock.lock();
+                frame->loading = false;
+                frame_cv.notify_all();
+                throw;
+            }
+
+            lock.lock();
+            frame->loading = false;
+            frame_cv.notify_all();
+            continue;
+        }
+
+        if (frame->valid) {
+            page_table.erase(frame->offset);
+            count(counters, owner, &cache_counters::evictions);
+        }
+
+        frame->offset = offset;
+        frame->valid = true;
+        frame->pins++;
+        page_table[offset] = frame;
+        lock.unlock();
+
+        count(counters, owner, &cache_counters::misses);
+
+        try {
+            auto start = std::chrono::steady_clock::now();
+            _storage->read_page(offset, frame->data);
+            count(counters, owner, &cache_counters::bytes_read, page_size);
+            count(counters, owner, &cache_counters::io_wait_ns, elapsed_ns(start));
+        } catch (...) {
+            lock.lock();
+            page_table.erase(offset);
+            frame->valid = false;
+            frame->loading = false;
+            frame->pins--;
+            frame_cv.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        frame->loading = false;
+        frame->referenced = true;
+        frame_cv.notify_all();
+        hint = frame_hint{.cache_id=id, .offset=offset, .frame=frame};
+
+        return frame;
+    }
+}
+
+void rainman::cache::_icache::unpin(page_frame *frame) {
+    if (--frame->pins == 0 && frame_waiters > 0) {
+        std::shared_lock<std::shared_mutex> lock(table_latch);
+        frame_cv.notify_all();
+    }
+}
+
+void rainman::cache::_icache::load_ahead(uint64_t offset) {
+    std::unique_lock<std::shared_mutex> lock(table_latch);
+
+    if (page_table.contains(offset)) {
+        return;
+    }
+
+    // Dirty frames are left to the foreground, so that read-ahead never waits on a write.
+    auto *frame = find_victim(true);
+    if (frame == nullptr || !claim(frame)) {
+        return;
+    }
+
+    if (frame->valid) {
+        page_table.erase(frame->offset);
+        count(counters, nullptr, &cache_counters::evictions);
+    }
+
+    frame->offset = offset;
+    frame->valid = true;
+    page_table[offset] = frame;
+    lock.unlock();
+
+    bool failed = false;
+    try {
+        _storage->read_page(offset, frame->data);
+        count(counters, nullptr, &cache_counters::prefetches);
+        count(counters, nullptr, &cache_counters::bytes_read, page_size);
+    } catch (...) {
+        failed = true;
+    }
+
+    lock.lock();
+    frame->loading = false;
+    frame->referenced = true;
+    if (failed) {
+        page_table.erase(offset);
+        frame->valid = false;
+    }
+
+    frame_cv.notify_all();
+}
+
+void rainman::cache::_icache::queue_prefetch(uint64_t first, uint64_t last) {
+    if (first >= last) {
+        return;
+    }
+
+    for (auto offset = first; offset < last; offset++) {
+        prefetch_queue.push_back(offset);
+    }
+
+    if (prefetchers.empty()) {
+        for (uint64_t i = 0; i < _storage->parallelism(); i++) {
+            prefetchers.emplace_back(&_icache::prefetch_loop, this);
+        }
+    }
+
+    prefetch_cv.notify_all();
+}
+
+void rainman::cache::_icache::prefetch_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        prefetch_cv.wait(lock, [this] { return stopping || !prefetch_queue.empty(); });
+        if (stopping) {
+            break;
+        }
+
+        auto offset = prefetch_queue.front();
+        prefetch_queue.pop_front();
+
+        lock.unlock();
+        load_ahead(offset);
+        lock.lock();
+    }
+}
+
+void rainman::cache::_icache::detect_sequential(uint64_t offset) {
+    // Read ahead once two consecutive pages have been accessed.
+    auto prev = last_page.exchange(offset);
+    if (prev == offset || prev + 1 != offset) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto n_pages = (space.end() + page_size - 1) / page_size;
+    auto first = std::max(offset + 1, prefetch_end);
+    auto last = std::min(offset + read_ahead + 1, n_pages);
+    if (first < last) {
+        queue_prefetch(first, last);
+        prefetch_end = last;
+    }
+}
+
+void rainman::cache::_icache::read_range(uint8_t *dest, uint64_t index, uint64_t length, cache_counters *owner) {
+    while (length > 0) {
+        uint64_t n;
+
+        if (_storage->mapped()) {
+            uint64_t avail;
+            auto *src = _storage->map(index, avail);
+            n = std::min(length, avail);
+            std::memcpy(dest, src, n);
+        } else {
+            auto offset = index / page_size;
+            auto page_index = index % page_size;
+            n = std::min(length, page_size - page_index);
+
+            auto *frame = pin(offset, owner);
+            while (true) {
+                auto version = frame->version.load(std::memory_order_acquire);
+                if (version & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                std::memcpy(dest, frame->data + page_index, n);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (frame->version.load(std::memory_order_relaxed) == version) {
+                    break;
+                }
+            }
+            unpin(frame);
+
+            if (read_ahead > 0) {
+                detect_sequential(offset);
+            }
+        }
+
+        dest += n;
+        index += n;
+        length -= n;
+    }
+}
+
+void rainman::cache::_icache::write_range(const uint8_t *src, uint64_t index, uint64_t length,
+                                          cache_counters *owner) {
+    while (length > 0) {
+        uint64_t n;
+
+        if (_storage->mapped()) {
+            uint64_t avail;
+            auto *dest = _storage->map(index, avail);
+            n = std::min(length, avail);
+            std::memcpy(dest, src, n);
+        } else {
+            auto offset = index / page_size;
+            auto page_index = index % page_size;
+            n = std::min(length, page_size - page_index);
+
+            if (dirty_limit != 0 && n_dirty >= dirty_limit) {
+                throttle();
+            }
+
+            auto *frame = pin(offset, owner);
+            frame->latch.lock();
+            frame->version.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(frame->data + page_index, src, n);
+            frame->version.fetch_add(1, std::memory_order_release);
+            mark_dirty(*frame, page_index, page_index + n);
+            frame->latch.unlock();
+            unpin(frame);
+
+            if (read_ahead > 0) {
+                detect_sequential(offset);
+            }
+        }
+
+        src += n;
+        index += n;
+        length -= n;
+    }
+}
+
+void rainman::cache::_icache::mark_dirty(page_frame &frame, uint64_t begin, uint64_t end) {
+    if (!frame.dirty) {
+        frame.dirty_begin = begin;
+        frame.dirty_end = end;
+        frame.dirty_since = dirty_clock++;
+        frame.dirty = true;
+
+        if (++n_dirty > dirty_limit / 2 && dirty_limit != 0) {
+            flush_cv.notify_one();
+        }
+    } else {
+        frame.dirty_begin = std::min(frame.dirty_begin, begin);
+        frame.dirty_end = std::max(frame.dirty_end, end);
+    }
+}
+
+void rainman::cache::_icache::pin_range(uint64_t index, uint64_t length, std::vector<page_segment> &segments,
+                                        cache_counters *owner) {
+    if (!_storage->mapped()) {
+        auto n_pages = (index + length + page_size - 1) / page_size - index / page_size;
+        std::shared_lock<std::shared_mutex> lock(table_latch);
+        if (n_pages > 1 && n_pages >= max_frames) {
+            throw MemoryErrors::InvalidOperationException("Cannot pin more pages than the cache has frames");
+        }
+    }
+
+    auto first = segments.size();
+
+    try {
+        while (length > 0) {
+            if (_storage->mapped()) {
+                uint64_t avail;
+                auto *data = _storage->map(index, avail);
+                auto n = std::min(length, avail);
+                segments.push_back(page_segment{.data=data, .length=n});
+
+                index += n;
+                length -= n;
+                continue;
+            }
+
+            auto offset = index / page_size;
+            auto page_index = index % page_size;
+            auto n = std::min(length, page_size - page_index);
+
+            auto *frame = pin(offset, owner);
+            segments.push_back(page_segment{.data=frame->data + page_index, .length=n, .frame=frame,
+                    .begin=page_index});
+            held_pins[id]++;
+
+            index += n;
+            length -= n;
+        }
+    } catch (...) {
+        unpin_range(std::vector<page_segment>(segments.begin() + (int64_t) first, segments.end()), false);
+        segments.resize(first);
+        throw;
+    }
+}
+
+void rainman::cache::_icache::unpin_range(const std::vector<page_segment> &segments, bool written) {
+    for (auto &segment : segments) {
+        if (segment.frame == nullptr) {
+            continue;
+        }
+
+        if (written) {
+            // Readers that copied the page meanwhile retry once they see the version move.
+            segment.frame->latch.lock();
+            segment.frame->version.fetch_add(2, std::memory_order_release);
+            mark_dirty(*segment.frame, segment.begin, segment.begin + segment.length);
+            segment.frame->latch.unlock();
+        }
+
+        held_pins[id]--;
+        unpin(segment.frame);
+    }
+}
+
+void rainman::cache::_icache::prefetch(uint64_t index, uint64_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    if (_storage->mapped()) {
+        _storage->advise(index, length);
+        return;
+    }
+
+    uint64_t n_frames;
+    {
+        std::shared_lock<std::shared_mutex> lock(table_latch);
+        n_frames = max_frames;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Never queue more pages than there are spare frames, or the prefetches would evict each other.
+    auto first = index / page_size;
+    auto last = std::min((index + length + page_size - 1) / page_size, first + n_frames - 1);
+    queue_prefetch(first, last);
+}
+
+uint64_t rainman::cache::_icache::write_dirty(uint64_t limit, bool foreground) {
+    std::unique_lock<std::mutex> write_lock(writing);
+
+    // Pin the dirty frames, so that none is evicted (and read back) before its data is in the page file.
+    std::vector<std::pair<uint64_t, page_frame *>> candidates;
+    {
+        std::shared_lock<std::shared_mutex> lock(table_latch);
+        for (auto *frame : frames) {
+            if (!frame->valid || frame->loading || !frame->dirty) {
+                continue;
+            }
+
+            frame->pins++;
+            candidates.emplace_back(frame->dirty_since, frame);
+        }
+    }
+
+    // Keep the oldest, since the newest are likely still being written to.
+    if (candidates.size() > limit) {
+        std::nth_element(candidates.begin(), candidates.begin() + (int64_t) limit, candidates.end(),
+                         [](auto &a, auto &b) { return a.first < b.first; });
+
+        for (auto k = limit; k < candidates.size(); k++) {
+            unpin(candidates[k].second);
+        }
+        candidates.resize(limit);
+    }
+
+    std::vector<page_frame *> dirty;
+    for (auto &[_, frame] : candidates) {
+        dirty.push_back(frame);
+    }
+
+    if (dirty.empty()) {
+        return 0;
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](auto *a, auto *b) { return a->offset < b->offset; });
+
+    auto max_run = std::max<uint64_t>(1, max_write_run / page_size);
+    std::unique_ptr<run_buffer> buffer;
+    try {
+        auto alignment = std::max<uint64_t>(_storage->alignment(), alignof(std::max_align_t));
+        buffer = std::make_unique<run_buffer>(std::min<uint64_t>(max_run, dirty.size()) * page_size, alignment);
+    } catch (...) {
+        for (auto *frame : dirty) {
+            unpin(frame);
+        }
+        throw;
+    }
+
+    std::vector<const uint8_t *> pages;
+    std::exception_ptr error;
+
+    for (uint64_t i = 0; i < dirty.size();) {
+        auto j = i + 1;
+        while (j < dirty.size() && j - i < max_run && dirty[j]->offset == dirty[j - 1]->offset + 1) {
+            j++;
+        }
+
+        // Copy the run and mark it clean under the frame latches, then write it without holding them, so that
+        // writers to these pages only wait for a memcpy. A write in between makes the page dirty again.
+        auto n = j - i;
+        pages.resize(n);
+
+        uint64_t begin = 0;
+        uint64_t end = page_size;
+        for (auto k = i; k < j; k++) {
+            auto *frame = dirty[k];
+            pages[k - i] = buffer->data + (k - i) * page_size;
+
+            frame->latch.lock();
+            std::memcpy(buffer->data + (k - i) * page_size, frame->data, page_size);
+            if (frame->dirty) {
+                if (n == 1) {
+                    begin = frame->dirty_begin;
+                    end = frame->dirty_end;
+                }
+                frame->dirty = false;
+                n_dirty--;
+            }
+            frame->latch.unlock();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            if (n == 1) {
+                _storage->write_page(dirty[i]->offset, buffer->data, begin, end);
+            } else {
+                _storage->write_pages(dirty[i]->offset, pages.data(), n);
+            }
+
+            count(counters, nullptr, &cache_counters::write_backs, n);
+            count(counters, nullptr, &cache_counters::bytes_written, n == 1 ? end - begin : n * page_size);
+            if (foreground) {
+                count(counters, nullptr, &cache_counters::io_wait_ns, elapsed_ns(start));
+            }
+        } catch (...) {
+            // The pages are not in the page file, so they must stay dirty.
+            for (auto k = i; k < j; k++) {
+                auto *frame = dirty[k];
+                frame->latch.lock();
+                if (!frame->dirty) {
+                    frame->dirty = true;
+                    n_dirty++;
+                }
+                frame->dirty_begin = 0;
+                frame->dirty_end = page_size;
+                frame->latch.unlock();
+            }
+
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+
+        i = j;
+    }
+
+    for (auto *frame : dirty) {
+        unpin(frame);
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return dirty.size();
+}
+
+void rainman::cache::_icache::flush_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        flush_cv.wait(lock, [this] { return stopping || n_dirty > dirty_limit / 2; });
+        if (stopping) {
+            break;
+        }
+
+        lock.unlock();
+
+        bool failed = false;
+        try {
+            // Write down to a quarter of the limit, so that runs of adjacent pages build up between wake-ups.
+            auto target = dirty_limit / 4;
+            auto excess = n_dirty.load();
+            if (excess > target) {
+                write_dirty(excess - target, false);
+            }
+        } catch (...) {
+            // The pages stay dirty and are written back by eviction, flush() or the next attempt.
+            failed = true;
+        }
+
+        lock.lock();
+        flushed_cv.notify_all();
+
+        if (failed) {
+            flush_cv.wait_for(lock, std::chrono::milliseconds(100));
+        }
+    }
+}
+
+void rainman::cache::_icache::throttle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    flush_cv.notify_one();
+
+    // Bounded, so that a failing page file slows writers down instead of blocking them.
+    flushed_cv.wait_for(lock, std::chrono::milliseconds(10), [this] { return n_dirty < dirty_limit; });
+}
+
+void rainman::cache::_icache::flush() {
+    if (persistent) {
+        save_catalog();
+    }
+
+    write_dirty(UINT64_MAX, true);
+    _storage->flush();
+}
+
+rainman::compression_stats rainman::cache::_icache::compression() {
+    auto *compressed = dynamic_cast<compressed_storage *>(_storage);
+    if (compressed == nullptr) {
+        return compression_stats{};
+    }
+
+    return compressed->stats();
+}
+
+std::shared_ptr<rainman::cache_counters> rainman::cache::_icache::attribute() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Counters no longer held by any virtual_array are folded into the cache's own.
+    std::erase_if(attributed, [this](auto &owner) {
+        if (owner.use_count() == 1) {
+            fold(*owner, counters);
+            return true;
+        }
+
+        return false;
+    });
+
+    return attributed.emplace_back(std::make_shared<cache_counters>());
+}
+
+rainman::cache_stats rainman::cache::_icache::stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto result = counters.snapshot();
+    for (auto &owner : attributed) {
+        for (auto [field, stat] : counter_fields) {
+            result.*stat += ((*owner).*field).load(std::memory_order_relaxed);
+        }
+    }
+
+    result.file_size = space.end();
+    result.free_bytes = space.free_bytes();
+    result.free_regions = space.region_count();
+    lock.unlock();
+
+    std::shared_lock<std::shared_mutex> table_lock(table_latch);
+    result.resident_pages = page_table.size();
+
+    return result;
+}
+
+void rainman::cache::_icache::reset_stats(cache_counters *owner) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (owner != nullptr) {
+        fold(*owner, counters);
+        return;
+    }
+
+    counters.reset();
+    for (auto &attributed_counters : attributed) {
+        attributed_counters->reset();
+    }
+}
+
+rainman::cache::_icache::_icache(const std::string &filename, uint64_t size, const cache_options &options,
+                                 const rainman::Allocator &allocator)
+        : _icache(options.persistent ? open_page_file(filename) : create_page_file(filename), size, options,
+                  allocator) {
 }
 
 rainman::cache::_icache::~_icache() {
-    _allocator.rfree(page);
-    std::fclose(page_file);
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+
+    prefetch_cv.notify_all();
+    for (auto &prefetcher : prefetchers) {
+        prefetcher.join();
+    }
+
+    if (flusher.joinable()) {
+        flush_cv.notify_all();
+        flusher.join();
+    }
+
+    if (persistent) {
+        try {
+            save_catalog();
+        } catch (...) {
+            // Destructors must not throw. The previous catalog stays in place.
+        }
+    }
+
+    release_frames();
 }
 
-rainman::cache::cache(FILE *fp, uint64_t size, const Allocator &allocator) {
+void rainman::cache::_icache::release_frames() {
+    // Leave the pool first, so that it no longer takes frames from this cache.
+    if (pool._inner != nullptr) {
+        pool._inner->leave(this);
+    }
+
+    for (auto *frame : frames) {
+        if (frame->valid) {
+            try {
+                write_back(*frame);
+            } catch (...) {
+                // This runs in the destructor, which must not throw.
+            }
+        }
+
+        if (pool._inner != nullptr) {
+            pool._inner->release(this, frame);
+        } else {
+            _allocator.rfree(frame->data);
+            _allocator.rfree(frame);
+        }
+    }
+
+    _allocator.rfree(_storage);
+}
+
+rainman::cache::cache(FILE *fp, uint64_t size, const Allocator &allocator)
+        : cache(fp, size, cache_options(), allocator) {
+}
+
+rainman::cache::cache(FILE *fp, uint64_t size, const cache_options &options, const Allocator &allocator) {
     _allocator = allocator;
-    _inner = _allocator.rnew<_icache>(1, fp, size, allocator);
+    _inner = _allocator.rnew<_icache>(1, fp, size, options, allocator);
+}
+
+rainman::cache::cache(const std::string &filename, uint64_t page_size, const Allocator &allocator)
+        : cache(filename, page_size, cache_options(), allocator) {
 }
 
-rainman::cache::cache(const std::string &filename, uint64_t page_size, const Allocator &allocator) {
+rainman::cache::cache(const std::string &filename, uint64_t page_size, const cache_options &options,
+                      const Allocator &allocator) {
     _allocator = allocator;
-    _inner = _allocator.rnew<_icache>(1, filename, page_size, allocator);
+    _inner = _allocator.rnew<_icache>(1, filename, page_size, options, allocator);
 }
 
 rainman::cache::~cache() {
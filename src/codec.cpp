@@ -0,0 +1,180 @@
+#include <cstring>
+#include "rainman/codec.h"
+
+/*
+ * lz_codec block format: a sequence of (token, literals, offset, match) records. The high nibble of the token is
+ * the literal count and the low nibble the match length minus 4; a nibble of 15 is followed by extension bytes that
+ * are added until one is below 255. Offsets are 2 bytes, little-endian. The last record has literals only.
+ */
+
+namespace {
+    inline uint32_t load32(const uint8_t *ptr) {
+        uint32_t value;
+        std::memcpy(&value, ptr, sizeof(uint32_t));
+        return value;
+    }
+
+    inline bool put_length(uint8_t *dest, uint64_t capacity, uint64_t &op, uint64_t length) {
+        while (length >= 255) {
+            if (op >= capacity) {
+                return false;
+            }
+            dest[op++] = 255;
+            length -= 255;
+        }
+
+        if (op >= capacity) {
+            return false;
+        }
+        dest[op++] = (uint8_t) length;
+
+        return true;
+    }
+
+    inline bool get_length(const uint8_t *src, uint64_t length, uint64_t &ip, uint64_t &value) {
+        uint8_t byte;
+        do {
+            if (ip >= length) {
+                return false;
+            }
+            byte = src[ip++];
+            value += byte;
+        } while (byte == 255);
+
+        return true;
+    }
+
+    // Emit a record with literals [src + anchor, src + anchor + n_literals) and, unless match_length is 0, a match.
+    inline bool put_record(const uint8_t *src, uint64_t anchor, uint64_t n_literals, uint64_t offset,
+                           uint64_t match_length, uint8_t *dest, uint64_t capacity, uint64_t &op) {
+        if (op >= capacity) {
+            return false;
+        }
+
+        auto token_pos = op++;
+        uint8_t token = (n_literals >= 15 ? 15 : n_literals) << 4;
+
+        if (n_literals >= 15 && !put_length(dest, capacity, op, n_literals - 15)) {
+            return false;
+        }
+
+        if (op + n_literals > capacity) {
+            return false;
+        }
+        std::memcpy(dest + op, src + anchor, n_literals);
+        op += n_literals;
+
+        if (match_length != 0) {
+            if (op + 2 > capacity) {
+                return false;
+            }
+            dest[op++] = offset & 0xff;
+            dest[op++] = offset >> 8;
+
+            auto extra = match_length - 4;
+            token |= extra >= 15 ? 15 : extra;
+
+            if (extra >= 15 && !put_length(dest, capacity, op, extra - 15)) {
+                return false;
+            }
+        }
+
+        dest[token_pos] = token;
+        return true;
+    }
+}
+
+uint64_t rainman::lz_codec::compress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t capacity) {
+    // Positions are stored plus one, so that 0 means an empty slot.
+    uint32_t table[1 << hash_bits] = {};
+
+    uint64_t ip = 0;
+    uint64_t anchor = 0;
+    uint64_t op = 0;
+
+    while (ip + min_match <= length) {
+        auto sequence = load32(src + ip);
+        auto hash = (sequence * 2654435761u) >> (32 - hash_bits);
+        auto ref = (uint64_t) table[hash];
+        table[hash] = (uint32_t) (ip + 1);
+
+        if (ref == 0 || ip - (ref - 1) > max_offset || load32(src + ref - 1) != sequence) {
+            ip++;
+            continue;
+        }
+
+        auto match_pos = ref - 1;
+        auto match_length = min_match;
+        while (ip + match_length < length && src[match_pos + match_length] == src[ip + match_length]) {
+            match_length++;
+        }
+
+        if (!put_record(src, anchor, ip - anchor, ip - match_pos, match_length, dest, capacity, op)) {
+            return 0;
+        }
+
+        ip += match_length;
+        anchor = ip;
+    }
+
+    if (!put_record(src, anchor, length - anchor, 0, 0, dest, capacity, op)) {
+        return 0;
+    }
+
+    return op;
+}
+
+bool rainman::lz_codec::decompress(const uint8_t *src, uint64_t length, uint8_t *dest, uint64_t dest_length) {
+    uint64_t ip = 0;
+    uint64_t op = 0;
+
+    while (ip < length) {
+        auto token = src[ip++];
+
+        uint64_t n_literals = token >> 4;
+        if (n_literals == 15 && !get_length(src, length, ip, n_literals)) {
+            return false;
+        }
+
+        if (ip + n_literals > length || op + n_literals > dest_length) {
+            return false;
+        }
+
+        std::memcpy(dest + op, src + ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+
+        if (ip == length) {
+            break;
+        }
+
+        if (ip + 2 > length) {
+            return false;
+        }
+
+        uint64_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+
+        uint64_t match_length = token & 0xf;
+        if (match_length == 15 && !get_length(src, length, ip, match_length)) {
+            return false;
+        }
+        match_length += min_match;
+
+        if (offset == 0 || offset > op || op + match_length > dest_length) {
+            return false;
+        }
+
+        if (offset >= match_length) {
+            std::memcpy(dest + op, dest + op - offset, match_length);
+            op += match_length;
+        } else {
+            // Overlapping match, e.g. a run of one repeated byte.
+            for (uint64_t i = 0; i < match_length; i++, op++) {
+                dest[op] = dest[op - offset];
+            }
+        }
+    }
+
+    return op == dest_length;
+}
@@ -0,0 +1,159 @@
+#include "rainman/freespace.h"
+
+uint64_t rainman::free_space::bin_of(uint64_t length) {
+    return 63 - __builtin_clzll(length);
+}
+
+void rainman::free_space::insert(uint64_t index, uint64_t length) {
+    _regions[index] = length;
+    _bins[bin_of(length)].insert({length, index});
+    _free_bytes += length;
+}
+
+void rainman::free_space::erase(uint64_t index, uint64_t length) {
+    _regions.erase(index);
+    _bins[bin_of(length)].erase({length, index});
+    _free_bytes -= length;
+}
+
+uint64_t rainman::free_space::allocate(uint64_t size) {
+    if (size == 0) {
+        return _end;
+    }
+
+    // Best fit within the size's own bin, otherwise the smallest region of the next non-empty bin.
+    for (auto bin = bin_of(size); bin < n_bins; bin++) {
+        auto iter = _bins[bin].lower_bound({size, 0});
+        if (iter == _bins[bin].end()) {
+            continue;
+        }
+
+        auto [length, index] = *iter;
+        erase(index, length);
+
+        if (length > size) {
+            insert(index + size, length - size);
+        }
+
+        return index;
+    }
+
+    auto index = _end;
+    _end += size;
+
+    return index;
+}
+
+bool rainman::free_space::extend(uint64_t index, uint64_t size) {
+    if (index == _end) {
+        _end += size;
+        return true;
+    }
+
+    auto iter = _regions.find(index);
+    if (iter == _regions.end()) {
+        return false;
+    }
+
+    auto length = iter->second;
+    if (length >= size) {
+        erase(index, length);
+        if (length > size) {
+            insert(index + size, length - size);
+        }
+        return true;
+    }
+
+    if (index + length == _end) {
+        erase(index, length);
+        _end = index + size;
+        return true;
+    }
+
+    return false;
+}
+
+uint64_t rainman::free_space::allocate_below(uint64_t size, uint64_t limit) {
+    for (auto &[index, length] : _regions) {
+        if (index + size > limit) {
+            break;
+        }
+
+        if (length >= size) {
+            auto region_index = index;
+            auto region_length = length;
+            erase(region_index, region_length);
+
+            if (region_length > size) {
+                insert(region_index + size, region_length - size);
+            }
+
+            return region_index;
+        }
+    }
+
+    return npos;
+}
+
+rainman::free_space::region rainman::free_space::release(uint64_t index, uint64_t length) {
+    if (length == 0) {
+        return region{.index=index, .length=0};
+    }
+
+    // Merge with the following region.
+    auto next = _regions.find(index + length);
+    if (next != _regions.end()) {
+        auto next_length = next->second;
+        erase(index + length, next_length);
+        length += next_length;
+    }
+
+    // Merge with the preceding region.
+    auto prev = _regions.lower_bound(index);
+    if (prev != _regions.begin()) {
+        prev--;
+        if (prev->first + prev->second == index) {
+            auto prev_index = prev->first;
+            auto prev_length = prev->second;
+            erase(prev_index, prev_length);
+            index = prev_index;
+            length += prev_length;
+        }
+    }
+
+    // A free region at the end of the file is trimmed off.
+    if (index + length == _end) {
+        _end = index;
+        return region{.index=index, .length=length};
+    }
+
+    insert(index, length);
+    return region{.index=index, .length=length};
+}
+
+void rainman::free_space::restore(uint64_t index, uint64_t length) {
+    if (length != 0) {
+        insert(index, length);
+    }
+}
+
+bool rainman::free_space::region_at(uint64_t index, region &result) const {
+    auto iter = _regions.find(index);
+    if (iter == _regions.end()) {
+        return false;
+    }
+
+    result = region{.index=iter->first, .length=iter->second};
+    return true;
+}
+
+std::vector<rainman::free_space::region> rainman::free_space::regions() const {
+    std::vector<region> result;
+    result.reserve(_regions.size());
+
+    for (auto &[index, length] : _regions) {
+        result.push_back(region{.index=index, .length=length});
+    }
+
+    return result;
+}
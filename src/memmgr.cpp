@@ -12,7 +12,7 @@ rainman::memmgr::memmgr(uint64_t map_size) {
 
 void rainman::memmgr::set_peak(uint64_t _peak_size) {
     lock();
-    _peak_size = _peak_size;
+    this->_peak_size = _peak_size;
 
     if (_allocation_size > _peak_size) {
         unlock();
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include "rainman/errors.h"
+#include "rainman/pool.h"
+
+rainman::buffer_pool::_ipool::_ipool(uint64_t budget, const Allocator &allocator)
+        : budget(budget), _allocator(allocator) {
+}
+
+rainman::buffer_pool::_ipool::member *rainman::buffer_pool::_ipool::find(pool_member *cache) {
+    for (auto &m : members) {
+        if (m.cache == cache) {
+            return &m;
+        }
+    }
+
+    return nullptr;
+}
+
+void rainman::buffer_pool::_ipool::join(pool_member *cache) {
+    std::unique_lock<std::mutex> lock(mutex);
+    members.push_back(member{.cache=cache, .bytes=0});
+}
+
+void rainman::buffer_pool::_ipool::leave(pool_member *cache) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::erase_if(members, [cache](auto &m) { return m.cache == cache; });
+}
+
+bool rainman::buffer_pool::_ipool::reclaim(pool_member *cache, uint64_t size) {
+    auto fair = budget / members.size();
+
+    std::vector<member *> candidates;
+    for (auto &m : members) {
+        if (m.cache != cache && m.bytes > fair) {
+            candidates.push_back(&m);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](auto *a, auto *b) { return a->bytes > b->bytes; });
+
+    for (auto *victim : candidates) {
+        while (used + size > budget && victim->bytes > fair) {
+            auto *frame = victim->cache->surrender();
+            if (frame == nullptr) {
+                break;
+            }
+
+            victim->bytes -= frame->size;
+            used -= frame->size;
+            reclaimed++;
+
+            _allocator.rfree(frame->data);
+            frame->data = nullptr;
+            frame->size = 0;
+            spare.push_back(frame);
+        }
+
+        if (used + size <= budget) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+rainman::page_frame *rainman::buffer_pool::_ipool::acquire(pool_member *cache, uint64_t size, uint64_t alignment) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto *self = find(cache);
+    if (self == nullptr) {
+        throw MemoryErrors::InvalidOperationException("Cache is not a member of the buffer pool");
+    }
+
+    if (used + size > budget && self->bytes != 0) {
+        // Only a cache below its fair share may take frames away from the others.
+        if (self->bytes + size > budget / members.size() || !reclaim(cache, size)) {
+            return nullptr;
+        }
+    }
+
+    page_frame *frame;
+    if (!spare.empty()) {
+        frame = spare.back();
+        spare.pop_back();
+    } else {
+        frame = _allocator.rnew<page_frame>(1);
+        n_frames++;
+    }
+
+    try {
+        frame->data = alignment > 1 ? _allocator.rmalloc_aligned<uint8_t>(size, alignment)
+                                    : _allocator.rmalloc<uint8_t>(size);
+    } catch (...) {
+        spare.push_back(frame);
+        throw;
+    }
+
+    frame->size = size;
+    used += size;
+    self->bytes += size;
+
+    return frame;
+}
+
+void rainman::buffer_pool::_ipool::release(pool_member *cache, page_frame *frame) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto *self = find(cache);
+    if (self != nullptr) {
+        self->bytes -= frame->size;
+    }
+
+    used -= frame->size;
+    _allocator.rfree(frame->data);
+    frame->data = nullptr;
+    frame->size = 0;
+    frame->valid = false;
+    frame->dirty = false;
+    spare.push_back(frame);
+}
+
+rainman::pool_stats rainman::buffer_pool::_ipool::stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    return pool_stats{
+            .budget=budget,
+            .used=used,
+            .caches=members.size(),
+            .frames=n_frames - spare.size(),
+            .reclaimed=reclaimed
+    };
+}
+
+rainman::buffer_pool::_ipool::~_ipool() {
+    // Every cache has returned its frames by now, since the caches keep the pool alive.
+    for (auto *frame : spare) {
+        _allocator.rfree(frame);
+    }
+}
+
+rainman::buffer_pool::buffer_pool(uint64_t budget, const Allocator &allocator) {
+    _allocator = allocator;
+    _inner = _allocator.rnew<_ipool>(1, budget, allocator);
+}
+
+rainman::buffer_pool::buffer_pool(const buffer_pool &copy) : ReferenceCounter(copy) {
+    _inner = copy._inner;
+    _allocator = copy._allocator;
+}
+
+rainman::buffer_pool &rainman::buffer_pool::operator=(const buffer_pool &rhs) {
+    if (this != &rhs) {
+        ReferenceCounter::copy(*this, rhs, true);
+        _inner = rhs._inner;
+        _allocator = rhs._allocator;
+    }
+
+    return *this;
+}
+
+rainman::buffer_pool::~buffer_pool() {
+    if (!refs() && _inner != nullptr) {
+        _allocator.rfree(_inner);
+    }
+}
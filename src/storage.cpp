@@ -0,0 +1,659 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include "rainman/errors.h"
+#include "rainman/storage.h"
+
+rainman::stdio_storage::stdio_storage(FILE *fp, uint64_t page_size) : storage(page_size) {
+    _file = fp;
+    _fd = fileno(fp);
+    std::fflush(_file);
+
+    struct stat file_stat{};
+    if (fstat(_fd, &file_stat) == 0) {
+        _size = file_stat.st_size;
+    }
+}
+
+void rainman::stdio_storage::read_page(uint64_t offset, uint8_t *frame) {
+    if (offset * _page_size >= _size) {
+        std::memset(frame, 0, _page_size);
+        return;
+    }
+
+    uint64_t n_read = 0;
+
+    while (n_read < _page_size) {
+        auto n = pread(_fd, frame + n_read, _page_size - n_read, (off_t) (offset * _page_size + n_read));
+        if (n < 0) {
+            throw MemoryErrors::IOException("Failed to read from the page file");
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        n_read += n;
+    }
+
+    if (n_read < _page_size) {
+        std::memset(frame + n_read, 0, _page_size - n_read);
+    }
+}
+
+void rainman::stdio_storage::write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) {
+    auto file_end = offset * _page_size + end;
+
+    while (begin < end) {
+        auto n = pwrite(_fd, frame + begin, end - begin, (off_t) (offset * _page_size + begin));
+        if (n < 0) {
+            throw MemoryErrors::IOException("Failed to write to the page file");
+        }
+
+        begin += n;
+    }
+
+    auto size = _size.load();
+    while (file_end > size && !_size.compare_exchange_weak(size, file_end)) {
+    }
+}
+
+void rainman::stdio_storage::write_pages(uint64_t offset, const uint8_t *const *pages, uint64_t n) {
+    std::vector<iovec> iov;
+    auto file_end = (offset + n) * _page_size;
+
+    while (n > 0) {
+        auto n_iov = std::min<uint64_t>(n, IOV_MAX);
+        iov.resize(n_iov);
+        for (uint64_t i = 0; i < n_iov; i++) {
+            iov[i] = iovec{.iov_base=const_cast<uint8_t *>(pages[i]), .iov_len=_page_size};
+        }
+
+        // pwritev may write less than asked for, so continue from wherever it stopped.
+        auto pos = offset * _page_size;
+        auto *next = iov.data();
+        auto remaining = n_iov;
+        while (remaining > 0) {
+            auto written = pwritev(_fd, next, (int) remaining, (off_t) pos);
+            if (written < 0) {
+                throw MemoryErrors::IOException("Failed to write to the page file");
+            }
+
+            pos += written;
+            while (remaining > 0 && (uint64_t) written >= next->iov_len) {
+                written -= (ssize_t) next->iov_len;
+                next++;
+                remaining--;
+            }
+
+            if (remaining > 0) {
+                next->iov_base = static_cast<uint8_t *>(next->iov_base) + written;
+                next->iov_len -= written;
+            }
+        }
+
+        offset += n_iov;
+        pages += n_iov;
+        n -= n_iov;
+    }
+
+    auto size = _size.load();
+    while (file_end > size && !_size.compare_exchange_weak(size, file_end)) {
+    }
+}
+
+namespace {
+    bool punch_hole(int fd, uint64_t index, uint64_t length) {
+        return length == 0 ||
+               fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) index, (off_t) length) == 0;
+    }
+}
+
+bool rainman::stdio_storage::discard(uint64_t index, uint64_t length) {
+    // Nothing past the end of the file takes up space.
+    uint64_t size = _size;
+    if (index >= size) {
+        return true;
+    }
+
+    return punch_hole(_fd, index, std::min(length, size - index));
+}
+
+bool rainman::stdio_storage::truncate(uint64_t size) {
+    if (size >= _size) {
+        return true;
+    }
+
+    if (ftruncate(_fd, (off_t) size) != 0) {
+        return false;
+    }
+
+    _size = size;
+    return true;
+}
+
+void rainman::stdio_storage::flush() {
+    // Pages are written with pwrite, so nothing is buffered in user space.
+}
+
+rainman::stdio_storage::~stdio_storage() {
+    std::fclose(_file);
+}
+
+rainman::direct_storage::direct_storage(FILE *fp, uint64_t page_size) : stdio_storage(fp, page_size) {
+    struct stat file_stat{};
+    if (fstat(_fd, &file_stat) != 0) {
+        throw MemoryErrors::IOException("Failed to stat the page file");
+    }
+
+    _block_size = std::max<uint64_t>(file_stat.st_blksize, 512);
+    if (page_size % _block_size != 0) {
+        throw MemoryErrors::InvalidOperationException(
+                "Direct I/O needs a page size that is a multiple of " + std::to_string(_block_size) + " bytes");
+    }
+
+    auto flags = fcntl(_fd, F_GETFL);
+    _direct = flags != -1 && fcntl(_fd, F_SETFL, flags | O_DIRECT) == 0;
+}
+
+void rainman::direct_storage::read_page(uint64_t offset, uint8_t *frame) {
+    if (offset * _page_size >= _size) {
+        std::memset(frame, 0, _page_size);
+        return;
+    }
+
+    uint64_t n_read = 0;
+
+    // A read that ends at an unaligned end of file cannot be continued with O_DIRECT: the rest is zeroes.
+    while (n_read < _page_size) {
+        auto n = pread(_fd, frame + n_read, _page_size - n_read, (off_t) (offset * _page_size + n_read));
+        if (n < 0) {
+            throw MemoryErrors::IOException("Failed to read from the page file");
+        }
+
+        n_read += n;
+        if (n == 0 || n_read % _block_size != 0) {
+            break;
+        }
+    }
+
+    if (n_read < _page_size) {
+        std::memset(frame + n_read, 0, _page_size - n_read);
+    }
+}
+
+void rainman::direct_storage::write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) {
+    begin = begin / _block_size * _block_size;
+    end = std::min((end + _block_size - 1) / _block_size * _block_size, _page_size);
+    stdio_storage::write_page(offset, frame, begin, end);
+}
+
+rainman::striped_storage::striped_storage(const std::vector<FILE *> &files, uint64_t page_size, bool direct)
+        : storage(page_size) {
+    for (uint64_t i = 0; i < files.size(); i++) {
+        try {
+            if (direct) {
+                _stripes.push_back(std::make_unique<direct_storage>(files[i], page_size));
+            } else {
+                _stripes.push_back(std::make_unique<stdio_storage>(files[i], page_size));
+            }
+        } catch (...) {
+            // The failed storage has closed its own file.
+            for (auto j = i + 1; j < files.size(); j++) {
+                std::fclose(files[j]);
+            }
+            throw;
+        }
+    }
+}
+
+void rainman::striped_storage::read_page(uint64_t offset, uint8_t *frame) {
+    stripe(offset)->read_page(offset / _stripes.size(), frame);
+}
+
+void rainman::striped_storage::write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) {
+    stripe(offset)->write_page(offset / _stripes.size(), frame, begin, end);
+}
+
+void rainman::striped_storage::write_pages(uint64_t offset, const uint8_t *const *pages, uint64_t n) {
+    auto n_stripes = _stripes.size();
+
+    // Every n_stripes-th page of the run goes to the same file, at consecutive pages there.
+    std::vector<std::vector<const uint8_t *>> shares(std::min(n, n_stripes));
+    for (uint64_t i = 0; i < n; i++) {
+        shares[i % n_stripes].push_back(pages[i]);
+    }
+
+    std::vector<std::exception_ptr> errors(shares.size());
+    auto write_share = [&](uint64_t i) {
+        try {
+            stripe(offset + i)->write_pages((offset + i) / n_stripes, shares[i].data(), shares[i].size());
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> writers;
+    for (uint64_t i = 1; i < shares.size(); i++) {
+        writers.emplace_back(write_share, i);
+    }
+
+    if (!shares.empty()) {
+        write_share(0);
+    }
+
+    for (auto &writer : writers) {
+        writer.join();
+    }
+
+    for (auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+bool rainman::striped_storage::discard(uint64_t index, uint64_t length) {
+    if (length == 0) {
+        return true;
+    }
+
+    auto n_stripes = _stripes.size();
+    auto first = index / _page_size;
+    auto last = (index + length - 1) / _page_size;
+
+    // The pages of a stripe within [first, last] are consecutive in its file, so each stripe discards one range.
+    bool discarded = true;
+    for (uint64_t s = 0; s < n_stripes; s++) {
+        auto p0 = first + (s + n_stripes - first % n_stripes) % n_stripes;
+        if (p0 > last) {
+            continue;
+        }
+        auto p1 = last - (last % n_stripes + n_stripes - s) % n_stripes;
+
+        auto begin = p0 / n_stripes * _page_size + (p0 == first ? index % _page_size : 0);
+        auto end = p1 / n_stripes * _page_size + (p1 == last ? index + length - last * _page_size : _page_size);
+        discarded = _stripes[s]->discard(begin, end - begin) && discarded;
+    }
+
+    return discarded;
+}
+
+bool rainman::striped_storage::truncate(uint64_t size) {
+    auto n_stripes = _stripes.size();
+    auto n_pages = size / _page_size;
+
+    bool truncated = true;
+    for (uint64_t s = 0; s < n_stripes; s++) {
+        auto stripe_size = (n_pages + n_stripes - 1 - s) / n_stripes * _page_size;
+        if (n_pages % n_stripes == s) {
+            stripe_size += size % _page_size;
+        }
+
+        truncated = _stripes[s]->truncate(stripe_size) && truncated;
+    }
+
+    return truncated;
+}
+
+uint64_t rainman::striped_storage::alignment() const {
+    uint64_t result = 1;
+    for (auto &s : _stripes) {
+        result = std::max(result, s->alignment());
+    }
+
+    return result;
+}
+
+void rainman::striped_storage::flush() {
+    for (auto &s : _stripes) {
+        s->flush();
+    }
+}
+
+rainman::mmap_storage::mmap_storage(FILE *fp, uint64_t page_size) : storage(page_size) {
+    _file = fp;
+    _fd = fileno(fp);
+
+    // Extents must start at multiples of the system page size.
+    auto sys_page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    _extent_size = std::max(default_extent_size, page_size);
+    _extent_size = (_extent_size + sys_page_size - 1) / sys_page_size * sys_page_size;
+
+    std::fflush(_file);
+    std::fseek(_file, 0, SEEK_END);
+    _file_size = std::ftell(_file);
+}
+
+void rainman::mmap_storage::grow(uint64_t size) {
+    // Grow the file a whole extent at a time so that every mapped extent is backed by the file.
+    size = (size + _extent_size - 1) / _extent_size * _extent_size;
+    if (size <= _file_size) {
+        return;
+    }
+
+    if (ftruncate(_fd, (off_t) size) != 0) {
+        throw MemoryErrors::IOException("Failed to grow the page file");
+    }
+
+    _file_size = size;
+}
+
+void rainman::mmap_storage::reserve(uint64_t size) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    grow(size);
+}
+
+uint8_t *rainman::mmap_storage::map_extent(uint64_t extent) {
+    if (extent / extents_per_block >= max_blocks) {
+        throw MemoryErrors::IOException("The page file is too large to map");
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto &block = _extents[extent / extents_per_block];
+    if (block.load(std::memory_order_relaxed) == nullptr) {
+        block.store(new std::atomic<uint8_t *>[extents_per_block](), std::memory_order_release);
+    }
+
+    auto &entry = block.load(std::memory_order_relaxed)[extent % extents_per_block];
+    if (entry.load(std::memory_order_relaxed) != nullptr) {
+        return entry.load(std::memory_order_relaxed);
+    }
+
+    grow((extent + 1) * _extent_size);
+
+    auto addr = ::mmap(nullptr, _extent_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd,
+                       (off_t) (extent * _extent_size));
+    if (addr == MAP_FAILED) {
+        throw MemoryErrors::IOException("Failed to map the page file");
+    }
+
+    entry.store(static_cast<uint8_t *>(addr), std::memory_order_release);
+    return static_cast<uint8_t *>(addr);
+}
+
+uint8_t *rainman::mmap_storage::map(uint64_t index, uint64_t &avail) {
+    auto extent = index / _extent_size;
+    auto extent_index = index % _extent_size;
+
+    // Extents stay mapped once they are, so only the first access to one takes the mutex.
+    uint8_t *extent_ptr = nullptr;
+    if (extent / extents_per_block < max_blocks) {
+        auto *block = _extents[extent / extents_per_block].load(std::memory_order_acquire);
+        if (block != nullptr) {
+            extent_ptr = block[extent % extents_per_block].load(std::memory_order_acquire);
+        }
+    }
+
+    if (extent_ptr == nullptr) {
+        extent_ptr = map_extent(extent);
+    }
+
+    avail = _extent_size - extent_index;
+    return extent_ptr + extent_index;
+}
+
+void rainman::mmap_storage::read_page(uint64_t offset, uint8_t *frame) {
+    auto index = offset * _page_size;
+    uint64_t length = _page_size;
+
+    while (length > 0) {
+        uint64_t avail;
+        auto *src = map(index, avail);
+        auto n = std::min(length, avail);
+        std::memcpy(frame, src, n);
+
+        frame += n;
+        index += n;
+        length -= n;
+    }
+}
+
+void rainman::mmap_storage::write_page(uint64_t offset, const uint8_t *frame, uint64_t begin, uint64_t end) {
+    auto index = offset * _page_size + begin;
+    auto length = end - begin;
+    frame += begin;
+
+    while (length > 0) {
+        uint64_t avail;
+        auto *dest = map(index, avail);
+        auto n = std::min(length, avail);
+        std::memcpy(dest, frame, n);
+
+        frame += n;
+        index += n;
+        length -= n;
+    }
+}
+
+void rainman::mmap_storage::advise(uint64_t index, uint64_t length) {
+    auto end = index + length;
+
+    while (index < end) {
+        uint64_t avail;
+        auto *ptr = map(index, avail);
+        auto n = std::min(end - index, avail);
+
+        // madvise needs a page-aligned address.
+        auto sys_page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+        auto aligned = (uintptr_t) ptr / sys_page_size * sys_page_size;
+        madvise((void *) aligned, n + ((uintptr_t) ptr - aligned), MADV_WILLNEED);
+
+        index += n;
+    }
+}
+
+bool rainman::mmap_storage::discard(uint64_t index, uint64_t length) {
+    uint64_t size;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size = _file_size;
+    }
+
+    if (index >= size) {
+        return true;
+    }
+
+    return punch_hole(_fd, index, std::min(length, size - index));
+}
+
+void rainman::mmap_storage::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (auto &block : _extents) {
+        auto *extents = block.load(std::memory_order_relaxed);
+        for (uint64_t i = 0; extents != nullptr && i < extents_per_block; i++) {
+            auto *extent = extents[i].load(std::memory_order_relaxed);
+            if (extent != nullptr) {
+                msync(extent, _extent_size, MS_SYNC);
+            }
+        }
+    }
+}
+
+rainman::mmap_storage::~mmap_storage() {
+    for (auto &block : _extents) {
+        auto *extents = block.load(std::memory_order_relaxed);
+        if (extents == nullptr) {
+            continue;
+        }
+
+        for (uint64_t i = 0; i < extents_per_block; i++) {
+            auto *extent = extents[i].load(std::memory_order_relaxed);
+            if (extent != nullptr) {
+                munmap(extent, _extent_size);
+            }
+        }
+
+        delete[] extents;
+    }
+
+    std::fclose(_file);
+}
+
+namespace {
+    // Scratch space for compressed pages, one per thread so that pages can be compressed concurrently.
+    thread_local std::vector<uint8_t> compression_buffer;
+
+    void pread_all(int fd, uint8_t *dest, uint64_t length, uint64_t pos) {
+        while (length > 0) {
+            auto n = pread(fd, dest, length, (off_t) pos);
+            if (n <= 0) {
+                throw MemoryErrors::IOException("Failed to read from the page file");
+            }
+
+            dest += n;
+            pos += n;
+            length -= n;
+        }
+    }
+
+    void pwrite_all(int fd, const uint8_t *src, uint64_t length, uint64_t pos) {
+        while (length > 0) {
+            auto n = pwrite(fd, src, length, (off_t) pos);
+            if (n < 0) {
+                throw MemoryErrors::IOException("Failed to write to the page file");
+            }
+
+            src += n;
+            pos += n;
+            length -= n;
+        }
+    }
+
+    uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+}
+
+rainman::compressed_storage::compressed_storage(FILE *fp, uint64_t page_size,
+                                                const std::shared_ptr<codec> &page_codec) : storage(page_size) {
+    _file = fp;
+    _fd = fileno(fp);
+    _codec = page_codec;
+}
+
+void rainman::compressed_storage::read_page(uint64_t offset, uint8_t *frame) {
+    _mutex.lock();
+    auto iter = _slots.find(offset);
+    if (iter == _slots.end()) {
+        _mutex.unlock();
+        std::memset(frame, 0, _page_size);
+        return;
+    }
+
+    auto slot = iter->second;
+    _mutex.unlock();
+
+    if (slot.raw) {
+        pread_all(_fd, frame, _page_size, slot.index);
+        _pages_read++;
+        return;
+    }
+
+    compression_buffer.resize(slot.length);
+    pread_all(_fd, compression_buffer.data(), slot.length, slot.index);
+
+    auto start = std::chrono::steady_clock::now();
+    if (!_codec->decompress(compression_buffer.data(), slot.length, frame, _page_size)) {
+        throw MemoryErrors::IOException("Corrupt compressed page");
+    }
+
+    _decompress_ns += elapsed_ns(start);
+    _pages_read++;
+}
+
+void rainman::compressed_storage::write_page(uint64_t offset, const uint8_t *frame, uint64_t, uint64_t) {
+    // Pages are compressed as a whole, so the dirty range is ignored.
+    compression_buffer.resize(_page_size);
+
+    auto start = std::chrono::steady_clock::now();
+    auto length = _codec->compress(frame, _page_size, compression_buffer.data(), _page_size - 1);
+    _compress_ns += elapsed_ns(start);
+
+    bool raw = length == 0;
+    const uint8_t *src = compression_buffer.data();
+    if (raw) {
+        length = _page_size;
+        src = frame;
+        _pages_stored_raw++;
+    }
+
+    _mutex.lock();
+
+    auto iter = _slots.find(offset);
+    page_slot slot{};
+
+    if (iter != _slots.end() && iter->second.capacity >= length) {
+        slot = iter->second;
+    } else {
+        if (iter != _slots.end()) {
+            _space.release(iter->second.index, iter->second.capacity);
+        }
+
+        slot.capacity = (length + slot_granularity - 1) / slot_granularity * slot_granularity;
+        slot.index = _space.allocate(slot.capacity);
+    }
+
+    slot.length = length;
+    slot.raw = raw;
+    _slots[offset] = slot;
+
+    _mutex.unlock();
+
+    pwrite_all(_fd, src, length, slot.index);
+
+    _pages_written++;
+    _bytes_in += _page_size;
+    _bytes_out += length;
+}
+
+bool rainman::compressed_storage::discard(uint64_t index, uint64_t length) {
+    auto first = (index + _page_size - 1) / _page_size;
+    auto last = (index + length) / _page_size;
+
+    _mutex.lock();
+
+    auto end = _space.end();
+    for (auto offset = first; offset < last; offset++) {
+        auto iter = _slots.find(offset);
+        if (iter != _slots.end()) {
+            _space.release(iter->second.index, iter->second.capacity);
+            _slots.erase(iter);
+        }
+    }
+
+    // Truncate under the mutex, so that no slot is allocated past the new end meanwhile.
+    bool truncated = _space.end() >= end || ftruncate(_fd, (off_t) _space.end()) == 0;
+
+    _mutex.unlock();
+
+    return truncated;
+}
+
+void rainman::compressed_storage::flush() {
+}
+
+rainman::compression_stats rainman::compressed_storage::stats() {
+    return compression_stats{
+            .pages_written=_pages_written,
+            .pages_read=_pages_read,
+            .pages_stored_raw=_pages_stored_raw,
+            .bytes_in=_bytes_in,
+            .bytes_out=_bytes_out,
+            .compress_ns=_compress_ns,
+            .decompress_ns=_decompress_ns
+    };
+}
+
+rainman::compressed_storage::~compressed_storage() {
+    std::fclose(_file);
+}
@@ -1,4 +1,17 @@
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <ranges>
+#include <string>
+#include <thread>
 #include <vector>
 #include <rainman/rainman.h>
 
@@ -121,6 +134,122 @@ TEST(MemoryTest, rainman_cache_5) {
     ASSERT_EQ(index1, index2);
 }
 
+TEST(MemoryTest, rainman_cache_6) {
+    remove("cache.rain");
+    auto tmp = fopen("cache.rain", "a");
+    fclose(tmp);
+
+    auto cache_file = fopen("cache.rain", "rb+");
+    auto cache = rainman::cache(cache_file, 16);
+
+    // A pure read scan must never write clean pages back.
+    for (int i = 0; i < 64; i++) {
+        ASSERT_EQ(cache.read<int>(i * sizeof(int)), 0);
+    }
+
+    cache.flush();
+
+    auto probe = fopen("cache.rain", "rb");
+    fseek(probe, 0, SEEK_END);
+    ASSERT_EQ(ftell(probe), 0);
+    fclose(probe);
+}
+
+TEST(MemoryTest, rainman_cache_7) {
+    remove("cache.rain");
+    auto tmp = fopen("cache.rain", "a");
+    fclose(tmp);
+
+    auto cache_file = fopen("cache.rain", "rb+");
+    auto cache = rainman::cache(cache_file, 64);
+
+    cache.write(1234, 8);
+    cache.flush();
+
+    // Only the dirty byte-range of the page is written back.
+    auto probe = fopen("cache.rain", "rb");
+    fseek(probe, 0, SEEK_END);
+    ASSERT_EQ(ftell(probe), 8 + sizeof(int));
+
+    int value = 0;
+    fseek(probe, 8, SEEK_SET);
+    fread(&value, sizeof(int), 1, probe);
+    fclose(probe);
+
+    ASSERT_EQ(value, 1234);
+}
+
+TEST(MemoryTest, rainman_cache_8) {
+    remove("cache.rain");
+    auto tmp = fopen("cache.rain", "a");
+    fclose(tmp);
+
+    auto cache_file = fopen("cache.rain", "rb+");
+    auto cache = rainman::cache(cache_file, 7);
+
+    std::vector<uint8_t> src(1000), dest(1000);
+    for (int i = 0; i < 1000; i++) {
+        src[i] = i % 251;
+    }
+
+    auto index = cache.allocate<uint8_t>(1000);
+    cache.write_range(src.data(), index, src.size());
+    cache.read_range(dest.data(), index, dest.size());
+
+    ASSERT_EQ(src, dest);
+}
+
+TEST(MemoryTest, rainman_cache_9) {
+    remove("cache.rain");
+    auto tmp = fopen("cache.rain", "a");
+    fclose(tmp);
+
+    auto cache_file = fopen("cache.rain", "rb+");
+    auto cache = rainman::cache(cache_file, 16);
+
+    auto a = cache.allocate<int>(1);
+    auto b = cache.allocate<int>(1);
+    auto c = cache.allocate<int>(1);
+    auto d = cache.allocate<int>(1);
+
+    // Freed neighbours coalesce into a single region.
+    cache.deallocate(a);
+    cache.deallocate(c);
+    cache.deallocate(b);
+    ASSERT_EQ(cache.allocate<int>(3), a);
+
+    // A free tail is trimmed off the end of the file.
+    cache.deallocate(d);
+    ASSERT_EQ(cache.allocate<int>(1), d);
+}
+
+TEST(MemoryTest, rainman_free_space_1) {
+    auto space = rainman::free_space();
+
+    std::vector<uint64_t> indices;
+    for (int i = 0; i < 1000; i++) {
+        indices.push_back(space.allocate(64 + i));
+    }
+
+    // Free every other region: nothing can merge, so each one is kept.
+    for (int i = 0; i < 1000; i += 2) {
+        space.release(indices[i], 64 + i);
+    }
+    ASSERT_EQ(space.region_count(), 500);
+
+    // Best fit picks the exact-size hole.
+    ASSERT_EQ(space.allocate(64 + 500), indices[500]);
+
+    for (int i = 1; i < 1000; i += 2) {
+        space.release(indices[i], 64 + i);
+    }
+    space.release(indices[500], 64 + 500);
+
+    ASSERT_EQ(space.region_count(), 0);
+    ASSERT_EQ(space.free_bytes(), 0);
+    ASSERT_EQ(space.end(), 0);
+}
+
 TEST(MemoryTest, rainman_virtual_array_1) {
     auto cache = rainman::cache("cache.rain", 0x2000);
 
@@ -154,6 +283,1019 @@ TEST(MemoryTest, rainman_virtual_array_2) {
     }
 }
 
+TEST(MemoryTest, rainman_virtual_array_3) {
+    auto cache = rainman::cache("cache.rain", 0x2000);
+
+    auto arr = rainman::virtual_array<int>(cache, 10485760);
+    std::vector<int> chunk(65536);
+
+    for (int i = 0; i < 10485760; i += 65536) {
+        for (int j = 0; j < 65536; j++) {
+            chunk[j] = i + j;
+        }
+
+        arr.set_range(chunk.data(), i, chunk.size());
+    }
+
+    for (int i = 0; i < 10485760; i += 65536) {
+        arr.get_range(chunk.data(), i, chunk.size());
+
+        for (int j = 0; j < 65536; j++) {
+            ASSERT_EQ(chunk[j], i + j);
+        }
+    }
+
+    ASSERT_EQ(arr[12345], 12345);
+    ASSERT_THROW(arr.get_range(chunk.data(), 10485760 - 10, chunk.size()), MemoryErrors::SegmentationFaultException);
+}
+
+TEST(MemoryTest, rainman_virtual_array_4) {
+    auto cache = rainman::cache("cache.rain", 0x2000, rainman::cache_options{.backend=rainman::cache_backend::mmap});
+
+    auto arr = rainman::virtual_array<uint64_t>(cache, 10485760);
+
+    for (uint64_t i = 0; i < 10485760; i++) {
+        arr.set(i * 3, i);
+    }
+
+    cache.flush();
+
+    for (uint64_t i = 0; i < 10485760; i++) {
+        ASSERT_EQ(arr[i], i * 3);
+    }
+}
+
+TEST(MemoryTest, rainman_virtual_array_5) {
+    auto cache = rainman::cache("cache.rain", 0x2000, rainman::cache_options{.frames=4, .read_ahead=8});
+
+    auto arr = rainman::virtual_array<uint32_t>(cache, 10485760);
+
+    for (uint32_t i = 0; i < 10485760; i++) {
+        arr.set(i ^ 0x5a5a5a5a, i);
+    }
+
+    for (uint32_t i = 0; i < 10485760; i++) {
+        ASSERT_EQ(arr[i], i ^ 0x5a5a5a5a);
+    }
+
+    // Random access across frames while prefetches are in flight.
+    arr.prefetch(0, 65536);
+    for (uint32_t i = 0; i < 100000; i++) {
+        auto j = (i * 2654435761u) % 10485760;
+        arr.set(j, j);
+        ASSERT_EQ(arr[j], j);
+    }
+}
+
+TEST(MemoryTest, rainman_virtual_array_6) {
+    remove("persistent.rain");
+
+    {
+        auto cache = rainman::cache("persistent.rain", 0x1000, rainman::cache_options{.persistent=true});
+        auto arr = rainman::virtual_array<uint64_t>(cache, "squares", 100000);
+        auto tmp = rainman::virtual_array<uint64_t>(cache, 1000);
+
+        for (uint64_t i = 0; i < 100000; i++) {
+            arr.set(i * i, i);
+        }
+    }
+
+    {
+        auto cache = rainman::cache("persistent.rain", 0x1000, rainman::cache_options{.persistent=true});
+        ASSERT_TRUE(cache.contains("squares"));
+
+        auto arr = rainman::virtual_array<uint64_t>(cache, "squares");
+        ASSERT_EQ(arr.size(), 100000);
+
+        for (uint64_t i = 0; i < 100000; i++) {
+            ASSERT_EQ(arr[i], i * i);
+        }
+
+        // New allocations must not overlap the re-attached array.
+        auto other = rainman::virtual_array<uint64_t>(cache, 1000);
+        for (uint64_t i = 0; i < 1000; i++) {
+            other.set(0, i);
+        }
+
+        ASSERT_EQ(arr[0], 0);
+        ASSERT_EQ(arr[99999], 99999ull * 99999ull);
+        ASSERT_THROW(rainman::virtual_array<uint64_t>(cache, "squares", 10), MemoryErrors::InvalidOperationException);
+
+        cache.release("squares");
+        ASSERT_FALSE(cache.contains("squares"));
+    }
+
+    // Every offset in the catalog assumes the page size the file was written with.
+    ASSERT_THROW(rainman::cache("persistent.rain", 0x2000, rainman::cache_options{.persistent=true}),
+                 MemoryErrors::IOException);
+
+    remove("persistent.rain");
+}
+
+TEST(MemoryTest, rainman_virtual_array_7) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=8});
+
+    std::vector<rainman::virtual_array<uint32_t>> arrays;
+    for (uint32_t t = 0; t < 4; t++) {
+        arrays.emplace_back(cache, 1048576);
+
+        for (uint32_t i = 0; i < 1048576; i++) {
+            arrays[t].set(i + t, i);
+        }
+    }
+
+    // Concurrent scans of different arrays on one cache, plus a writer, share frames without a cache-wide lock.
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> errors{};
+
+    for (uint32_t t = 0; t < 3; t++) {
+        threads.emplace_back([&arrays, &errors, t]() {
+            auto arr = arrays[t];
+            for (int pass = 0; pass < 2; pass++) {
+                for (uint32_t i = 0; i < 1048576; i++) {
+                    if (arr[i] != i + t) {
+                        errors++;
+                    }
+                }
+            }
+        });
+    }
+
+    threads.emplace_back([&arrays]() {
+        auto arr = arrays[3];
+        for (uint32_t i = 0; i < 1048576; i++) {
+            arr.set(arr[i] * 2, i);
+        }
+    });
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_EQ(errors, 0);
+    for (uint32_t i = 0; i < 1048576; i++) {
+        ASSERT_EQ(arrays[3][i], (i + 3) * 2);
+    }
+}
+
+TEST(MemoryTest, rainman_virtual_array_8) {
+    auto codec = std::make_shared<rainman::lz_codec>();
+    auto cache = rainman::cache("cache.rain", 0x4000, rainman::cache_options{.frames=2, .compression=codec});
+
+    // Sorted ids with long runs compress well.
+    auto arr = rainman::virtual_array<uint32_t>(cache, 4194304);
+    for (uint32_t i = 0; i < 4194304; i++) {
+        arr.set(i / 64, i);
+    }
+
+    for (uint32_t i = 0; i < 4194304; i++) {
+        ASSERT_EQ(arr[i], i / 64);
+    }
+
+    cache.flush();
+
+    auto stats = cache.compression();
+    ASSERT_GT(stats.pages_written, 0);
+    ASSERT_GT(stats.ratio(), 2.0);
+}
+
+TEST(MemoryTest, rainman_virtual_array_9) {
+    auto allocator = rainman::Allocator().create_child();
+
+    {
+        // A dataset that fits in the budget never touches the page file.
+        auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.memory_budget=0x400000}, allocator);
+        auto arr = rainman::virtual_array<uint32_t>(cache, 524288);
+
+        for (uint32_t i = 0; i < 524288; i++) {
+            arr.set(i, i);
+        }
+
+        for (uint32_t i = 0; i < 524288; i++) {
+            ASSERT_EQ(arr[i], i);
+        }
+
+        auto probe = fopen("cache.rain", "rb");
+        fseek(probe, 0, SEEK_END);
+        ASSERT_EQ(ftell(probe), 0);
+        fclose(probe);
+    }
+
+    {
+        // The Allocator's peak size caps the hot tier below the budget, and the rest spills to the file.
+        allocator.peak_size(0x100000);
+        auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.memory_budget=0x400000}, allocator);
+        auto arr = rainman::virtual_array<uint32_t>(cache, 1048576);
+
+        for (uint32_t i = 0; i < 1048576; i++) {
+            arr.set(i * 7, i);
+        }
+
+        ASSERT_LE(allocator.alloc_size(), 0x100000);
+
+        for (uint32_t i = 0; i < 1048576; i++) {
+            ASSERT_EQ(arr[i], i * 7);
+        }
+    }
+}
+
+TEST(MemoryTest, rainman_virtual_array_10) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    auto arr = rainman::virtual_array<uint32_t>(cache, 100000);
+
+    uint32_t state = 7;
+    for (auto &&element : arr) {
+        state = state * 1103515245 + 12345;
+        element = state >> 8;
+    }
+
+    std::sort(arr.begin(), arr.end());
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+
+    std::transform(arr.begin(), arr.end(), arr.begin(), [](uint32_t x) { return x / 2; });
+    for (uint64_t i = 1; i < arr.size(); i++) {
+        ASSERT_LE(arr[i - 1], arr[i]);
+        ASSERT_LT(arr[i], 1u << 23);
+    }
+
+    std::reverse(arr.begin(), arr.end());
+    arr.at(0) = arr.at(1);
+    ASSERT_EQ(arr[0], arr[1]);
+    ASSERT_EQ(arr.end() - arr.begin(), 100000);
+    ASSERT_THROW(arr.at(100000), MemoryErrors::SegmentationFaultException);
+}
+
+TEST(MemoryTest, rainman_columnar_array_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    struct sample {
+        uint32_t x;
+        uint32_t y;
+        uint64_t z;
+    };
+
+    auto arr = rainman::columnar_array<sample, &sample::x, &sample::y, &sample::z>(cache, 100000);
+    std::vector<sample> chunk(1000);
+
+    for (uint32_t i = 0; i < 100000; i += 1000) {
+        for (uint32_t j = 0; j < 1000; j++) {
+            chunk[j] = sample{.x=i + j, .y=(i + j) * 2, .z=(i + j) * 3ull};
+        }
+        arr.set_range(chunk.data(), i, chunk.size());
+    }
+    arr.set(sample{.x=1, .y=2, .z=3}, 99999);
+    cache.flush();
+
+    // A scan of x only reads x's column: a sixth of the data.
+    auto before = cache.stats().bytes_read;
+    uint64_t sum = 0;
+    arr.scan<&sample::x>(0, arr.size(), [&sum](uint64_t /* i */, uint32_t x) { sum += x; });
+    ASSERT_EQ(sum, 99998ull * 99999 / 2 + 1);
+    ASSERT_LE(cache.stats().bytes_read - before, 400000 + 2 * 0x1000);
+
+    arr.get_range(chunk.data(), 5000, chunk.size());
+    for (uint32_t j = 0; j < 1000; j++) {
+        ASSERT_EQ(chunk[j].x, 5000 + j);
+        ASSERT_EQ(chunk[j].y, (5000 + j) * 2);
+        ASSERT_EQ(chunk[j].z, (5000 + j) * 3ull);
+    }
+
+    ASSERT_EQ(arr[99999].z, 3);
+    ASSERT_EQ(arr.column<&sample::y>()[7], 14);
+
+    // The array's stats are the sum of its columns'.
+    auto total = arr.column<&sample::x>().stats();
+    total += arr.column<&sample::y>().stats();
+    total += arr.column<&sample::z>().stats();
+    ASSERT_EQ(arr.stats().hits, total.hits);
+    ASSERT_EQ(arr.stats().bytes_read, total.bytes_read);
+}
+
+TEST(MemoryTest, rainman_external_sort_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=16});
+    auto arr = rainman::virtual_array<uint64_t>(cache, 1000000);
+
+    std::vector<uint64_t> expected(arr.size());
+    uint64_t state = 11;
+    for (uint64_t i = 0; i < arr.size(); i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        expected[i] = state >> 20;
+    }
+    arr.set_range(expected.data(), 0, expected.size());
+
+    // 256 KiB runs, sorted by 4 threads in a 1 MiB budget, take two merge passes of up to 15 runs.
+    // The Allocator's peak bounds the memory used.
+    auto allocator = rainman::Allocator().create_child();
+    allocator.peak_size(0x100000);
+    auto scratch = rainman::cache("storage.rain", 0x1000, rainman::cache_options{.frames=16});
+
+    rainman::external_sort(arr, std::greater<>(), rainman::sort_options{.memory_budget=0x100000, .threads=4,
+            .scratch=scratch, .allocator=allocator});
+
+    std::sort(expected.begin(), expected.end(), std::greater<>());
+    std::vector<uint64_t> sorted(arr.size());
+    arr.get_range(sorted.data(), 0, sorted.size());
+    ASSERT_EQ(sorted, expected);
+}
+
+TEST(MemoryTest, rainman_parallel_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=64});
+    auto arr = rainman::virtual_array<uint32_t>(cache, 1000003);
+    auto squares = rainman::virtual_array<uint64_t>(cache, 1000003);
+    auto options = rainman::parallel_options{.threads=4, .chunk_pages=2};
+
+    for (uint32_t i = 0; i < arr.size(); i++) {
+        arr.set(i, i);
+    }
+
+    rainman::parallel_for_each(arr, [](uint32_t &x) { x *= 3; }, options);
+    rainman::parallel_transform(arr, squares, [](uint32_t x) { return (uint64_t) x * x; }, options);
+
+    for (uint32_t i = 0; i < arr.size(); i += 997) {
+        ASSERT_EQ(arr[i], i * 3);
+        ASSERT_EQ(squares[i], 9ull * i * i);
+    }
+
+    auto sum = rainman::parallel_reduce(arr, (uint64_t) 0, std::plus<>(), options);
+    ASSERT_EQ(sum, 3ull * 1000002 * 1000003 / 2);
+
+    // Every chunk is folded from init, through op.
+    auto largest = rainman::parallel_reduce(squares, (uint64_t) 0, [](uint64_t a, uint64_t b) {
+        return std::max(a, b);
+    }, options);
+    ASSERT_EQ(largest, 9ull * 1000002 * 1000002);
+}
+
+TEST(MemoryTest, rainman_virtual_array_11) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=8});
+    auto arr = rainman::virtual_array<uint32_t>(cache, 0);
+    auto copy = arr;
+
+    // At the end of the file the array grows in place.
+    auto index = arr.index();
+    for (uint32_t i = 0; i < 100000; i++) {
+        arr.push_back(i);
+    }
+    ASSERT_EQ(arr.index(), index);
+    ASSERT_GE(arr.capacity(), 100000);
+    ASSERT_LT(arr.capacity(), 200000);
+    ASSERT_EQ(copy.size(), 100000);
+
+    // Behind another allocation it moves, unless it still has room.
+    auto blocker = rainman::virtual_array<uint8_t>(cache, 10);
+    std::vector<uint32_t> tail(arr.capacity() - arr.size() + 1000);
+    for (uint32_t i = 0; i < tail.size(); i++) {
+        tail[i] = 100000 + i;
+    }
+    arr.append_range(tail.data(), tail.size());
+    ASSERT_NE(arr.index(), index);
+
+    for (uint32_t i = 0; i < arr.size(); i++) {
+        ASSERT_EQ(copy[i], i);
+    }
+
+    arr.resize(10);
+    arr.shrink_to_fit();
+    ASSERT_EQ(arr.capacity(), 10);
+    ASSERT_EQ(arr[9], 9);
+    ASSERT_THROW(arr.at(10), MemoryErrors::SegmentationFaultException);
+}
+
+TEST(MemoryTest, rainman_virtual_array_12) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    auto arr = rainman::virtual_array<uint64_t>(cache, 4096);
+
+    {
+        auto view = arr.pin_mutable(0, 4096 / 4);
+        uint64_t i = 0;
+        for (auto segment : view.segments()) {
+            for (auto &value : segment) {
+                value = i++ * 3;
+            }
+        }
+        ASSERT_EQ(i, 1024);
+        ASSERT_EQ(view.size(), 1024);
+    }
+
+    // The pinned page stays resident while the others are cycled through the remaining frames.
+    auto view = arr.pin(0, 16);
+    auto span = view.span();
+    for (uint64_t i = 1024; i < 4096; i++) {
+        arr.set(i, i);
+    }
+    for (uint64_t i = 0; i < 16; i++) {
+        ASSERT_EQ(span[i], i * 3);
+    }
+    view.release();
+
+    for (uint64_t i = 0; i < 1024; i++) {
+        ASSERT_EQ(arr[i], i * 3);
+    }
+
+    ASSERT_THROW(arr.pin(0, 4096), MemoryErrors::InvalidOperationException);
+    ASSERT_THROW(arr.pin(4000, 100), MemoryErrors::SegmentationFaultException);
+
+    auto odd = rainman::virtual_array<std::array<uint8_t, 3>>(cache, 4096);
+    ASSERT_THROW(odd.pin(0, 4096 / 3 + 1), MemoryErrors::InvalidOperationException);
+}
+
+TEST(MemoryTest, rainman_virtual_array_13) {
+    auto cache = rainman::cache("cache.rain", 0x1000);
+    auto arr = rainman::virtual_array<uint64_t>(cache, 4096);
+
+    // The view holds the only frame, so reading another page could never get one.
+    auto view = arr.pin(0, 16);
+    ASSERT_EQ(arr[8], 0);
+    ASSERT_THROW(arr[2048], MemoryErrors::InvalidOperationException);
+    ASSERT_THROW(arr.pin(2048, 16), MemoryErrors::InvalidOperationException);
+    view.release();
+
+    arr.set(7, 2048);
+    ASSERT_EQ(arr[2048], 7);
+}
+
+TEST(MemoryTest, rainman_virtual_array_14) {
+    auto cache = rainman::cache("cache.rain", 0x1000);
+    auto arr = rainman::virtual_array<uint64_t>(cache, 8192);
+    arr.set(42, 4096);
+
+    // A reader waits for the only frame while another thread holds it, and wakes when it is released.
+    for (int i = 0; i < 100; i++) {
+        auto view = arr.pin(0, 1);
+        std::atomic<bool> done{};
+        std::thread reader([&arr, &done]() {
+            ASSERT_EQ(arr[4096], 42);
+            done = true;
+        });
+
+        std::this_thread::sleep_for(std::chrono::microseconds(i * 10));
+        ASSERT_FALSE(done);
+        view.release();
+        reader.join();
+        ASSERT_TRUE(done);
+    }
+}
+
+struct record_sample {
+    uint32_t id;
+    std::string name;
+    std::vector<std::string> tags;
+
+    static constexpr auto serialized_fields = std::make_tuple(&record_sample::id, &record_sample::name,
+                                                              &record_sample::tags);
+};
+
+TEST(MemoryTest, rainman_record_array_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+
+    {
+        auto records = rainman::record_array<record_sample>(cache, "samples");
+        std::vector<record_sample> batch;
+        for (uint32_t i = 0; i < 10000; i++) {
+            batch.push_back(record_sample{.id=i, .name=std::string(i % 50, 'a' + i % 26),
+                    .tags=std::vector<std::string>(i % 3, std::to_string(i))});
+        }
+        records.append_range(batch.data(), batch.size());
+        records.push_back(record_sample{.id=10000, .name="last", .tags={}});
+        ASSERT_EQ(records.size(), 10001);
+    }
+
+    auto records = rainman::record_array<record_sample>(cache, "samples");
+    ASSERT_EQ(records.size(), 10001);
+    for (uint32_t i = 0; i < 10000; i++) {
+        auto sample = records[i];
+        ASSERT_EQ(sample.id, i);
+        ASSERT_EQ(sample.name, std::string(i % 50, 'a' + i % 26));
+        ASSERT_EQ(sample.tags, std::vector<std::string>(i % 3, std::to_string(i)));
+    }
+    ASSERT_EQ(records[10000].name, "last");
+    ASSERT_THROW(records[10001], MemoryErrors::SegmentationFaultException);
+
+    // Trivially copyable values are stored byte for byte.
+    auto values = rainman::record_array<uint64_t>(cache);
+    values.push_back(42);
+    ASSERT_EQ(values.bytes(), sizeof(uint64_t));
+    ASSERT_EQ(values[0], 42);
+}
+
+TEST(MemoryTest, rainman_string_array_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    auto strings = rainman::virtual_string_array(cache);
+
+    std::vector<std::string> batch;
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < 20000; i++) {
+        batch.emplace_back(i % 50 == 0 ? i % 3000 : i % 300, (char) ('a' + i % 26));
+        bytes += batch.back().size();
+    }
+
+    strings.reserve(batch.size(), 2 * bytes);
+    strings.append_range(std::vector<std::string>(batch.begin(), batch.begin() + 10000));
+    strings.append_range(std::vector<std::string_view>(batch.begin() + 10000, batch.end()));
+    strings.push_back(std::string(10000, 'z'));
+    ASSERT_EQ(strings.size(), 20001);
+    ASSERT_LT(strings.bytes(), bytes + bytes / 10 + 10000);
+
+    // Strings that fit in a page are never split across pages, so they are read in place.
+    for (uint64_t i = 0; i < batch.size(); i++) {
+        auto view = strings.view(i);
+        ASSERT_EQ(view.str(), batch[i]);
+        ASSERT_TRUE(view.pinned() || batch[i].empty());
+    }
+
+    auto view = strings.view(20000);
+    ASSERT_FALSE(view.pinned());
+    ASSERT_EQ(view.str(), std::string(10000, 'z'));
+    ASSERT_EQ(strings[20000], std::string(10000, 'z'));
+    ASSERT_THROW(strings[20001], MemoryErrors::SegmentationFaultException);
+
+    // Ranges without random access, and ranges of temporaries, are walked once per pass.
+    strings.append_range(std::list<std::string>{"list", "of", "strings"});
+    strings.append_range(std::views::iota(0, 3) | std::views::transform([](int i) { return std::to_string(i); }));
+    ASSERT_EQ(strings.size(), 20007);
+    ASSERT_EQ(strings[20002], "of");
+    ASSERT_EQ(strings[20006], "2");
+
+    auto blobs = rainman::virtual_blob_array(cache, "blobs");
+    uint32_t values[] = {1, 2, 3};
+    blobs.push_back(values, sizeof(values));
+    blobs = rainman::virtual_blob_array(cache, "blobs");
+    ASSERT_EQ(blobs.size(), 1);
+    ASSERT_EQ(blobs.length(0), sizeof(values));
+    ASSERT_EQ(blobs.get(0)[4], 2);
+}
+
+TEST(MemoryTest, rainman_string_array_2) {
+    remove("persistent.rain");
+
+    {
+        auto cache = rainman::cache("persistent.rain", 0x1000, rainman::cache_options{.persistent=true});
+
+        // Named arrays grow geometrically and keep their size apart from their capacity.
+        auto arr = rainman::virtual_array<uint64_t>(cache, "numbers", 0);
+        for (uint64_t i = 0; i < 1000; i++) {
+            arr.push_back(i);
+        }
+        ASSERT_EQ(arr.capacity(), 1024);
+
+        auto strings = rainman::virtual_string_array(cache, "strings");
+        strings.reserve(5000, 5000 * 16);
+        for (uint64_t i = 0; i < 5000; i++) {
+            strings.push_back(std::to_string(i));
+        }
+    }
+
+    {
+        auto cache = rainman::cache("persistent.rain", 0x1000, rainman::cache_options{.persistent=true});
+        auto arr = rainman::virtual_array<uint64_t>(cache, "numbers");
+        ASSERT_EQ(arr.size(), 1000);
+        ASSERT_EQ(arr.capacity(), 1024);
+        ASSERT_EQ(arr[999], 999);
+        ASSERT_THROW(rainman::virtual_array<uint64_t>(cache, "numbers", 1024), MemoryErrors::InvalidOperationException);
+
+        auto strings = rainman::virtual_string_array(cache, "strings");
+        ASSERT_EQ(strings.size(), 5000);
+        for (uint64_t i = 0; i < 5000; i++) {
+            ASSERT_EQ(strings[i], std::to_string(i));
+        }
+
+        // With a single frame, a held view leaves none for reading another page.
+        auto small = rainman::cache("cache.rain", 0x1000);
+        auto copy = rainman::virtual_string_array(small);
+        copy.append_range(std::vector<std::string>(1000, std::string(100, 'x')));
+        auto view = copy.view(0);
+        ASSERT_TRUE(view.pinned());
+        ASSERT_THROW(copy[999], MemoryErrors::InvalidOperationException);
+    }
+
+    remove("persistent.rain");
+}
+
+TEST(MemoryTest, rainman_hash_map_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=8});
+    auto map = rainman::virtual_hash_map<uint64_t, uint64_t>(cache, 4);
+
+    for (uint64_t i = 0; i < 100000; i++) {
+        ASSERT_TRUE(map.insert(i * 7, i));
+    }
+    ASSERT_FALSE(map.insert(7, 0));
+    ASSERT_FALSE(map.insert_or_assign(7, 42));
+    ASSERT_EQ(map.size(), 100000);
+
+    // Linear hashing keeps the buckets about as full as the load factor allows.
+    ASSERT_GE(map.buckets(), 100000 / 255);
+    ASSERT_LT(map.overflow_pages(), map.buckets() / 4);
+
+    for (uint64_t i = 0; i < 50000; i++) {
+        ASSERT_TRUE(map.erase(i * 14));
+    }
+    ASSERT_FALSE(map.erase(0));
+    ASSERT_EQ(map.size(), 50000);
+
+    map.reset_stats();
+    for (uint64_t i = 0; i < 100000; i++) {
+        auto value = map.find(i * 7);
+        if (i % 2 == 0) {
+            ASSERT_FALSE(value.has_value());
+        } else {
+            ASSERT_EQ(*value, i == 1 ? 42 : i);
+        }
+    }
+
+    // A lookup touches its bucket's page, and an overflow page only rarely.
+    auto stats = map.stats();
+    ASSERT_LT(stats.hits + stats.misses, 100000 + 100000 / 4);
+}
+
+TEST(MemoryTest, rainman_hash_map_2) {
+    // A single frame is enough, even when buckets overflow.
+    auto cache = rainman::cache("cache.rain", 0x1000);
+    auto map = rainman::virtual_hash_map<uint64_t, uint64_t>(cache, 1, 4.0);
+
+    for (uint64_t i = 0; i < 20000; i++) {
+        ASSERT_TRUE(map.insert(i, i * 3));
+    }
+    ASSERT_GT(map.overflow_pages(), 0);
+
+    for (uint64_t i = 0; i < 20000; i++) {
+        ASSERT_EQ(*map.find(i), i * 3);
+    }
+    ASSERT_FALSE(map.contains(20000));
+}
+
+TEST(MemoryTest, rainman_btree_1) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=8});
+
+    auto keys = rainman::virtual_array<uint64_t>(cache, 100000);
+    auto values = rainman::virtual_array<uint32_t>(cache, 100000);
+    for (uint64_t i = 0; i < 100000; i++) {
+        keys.set(i * 10, i);
+        values.set((uint32_t) i, i);
+    }
+
+    auto tree = rainman::virtual_btree<uint64_t, uint32_t>(cache);
+    tree.bulk_load(keys, values, 0.9);
+    ASSERT_EQ(tree.size(), 100000);
+    ASSERT_EQ(tree.height(), 3);
+    ASSERT_THROW(tree.bulk_load(keys, values), MemoryErrors::InvalidOperationException);
+
+    // Fill the gaps between the loaded keys, in random order, so that leaves and inner nodes split.
+    std::vector<uint64_t> gaps;
+    for (uint64_t i = 0; i < 100000; i++) {
+        gaps.push_back(i * 10 + 5);
+    }
+    std::shuffle(gaps.begin(), gaps.end(), std::mt19937_64(42));
+    for (auto key : gaps) {
+        ASSERT_TRUE(tree.insert(key, (uint32_t) key));
+    }
+    ASSERT_FALSE(tree.insert(5, 0));
+    ASSERT_FALSE(tree.insert_or_assign(10, 7));
+    ASSERT_EQ(tree.size(), 200000);
+
+    ASSERT_EQ(*tree.find(10), 7);
+    ASSERT_EQ(*tree.find(999995), 999995);
+    ASSERT_FALSE(tree.find(3).has_value());
+
+    // A range scan follows the leaf links in key order.
+    uint64_t expected = 5000;
+    for (auto it = tree.lower_bound(4999); it != tree.end() && it.key() < 6000; ++it) {
+        ASSERT_EQ(it.key(), expected);
+        ASSERT_EQ(it.value(), expected % 10 == 0 ? expected / 10 : expected);
+        expected += 5;
+    }
+    ASSERT_EQ(expected, 6000);
+
+    uint64_t n = 0;
+    uint64_t previous = 0;
+    for (auto [key, value] : tree) {
+        ASSERT_TRUE(n == 0 || key > previous);
+        previous = key;
+        n++;
+    }
+    ASSERT_EQ(n, 200000);
+
+    auto unsorted = rainman::virtual_btree<uint64_t, uint32_t>(cache);
+    keys.set(0, 5);
+    ASSERT_THROW(unsorted.bulk_load(keys, values), MemoryErrors::InvalidOperationException);
+    ASSERT_EQ(unsorted.pages(), 0);
+}
+
+TEST(MemoryTest, rainman_btree_2) {
+    // A single frame cannot hold a node and its new sibling, so the tree is refused rather than left to hang.
+    auto small = rainman::cache("cache.rain", 0x1000);
+    ASSERT_EQ(small.frames(), 1);
+    ASSERT_THROW((rainman::virtual_btree<uint64_t, uint64_t>(small)), MemoryErrors::InvalidOperationException);
+
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=2});
+    auto tree = rainman::virtual_btree<uint64_t, uint64_t>(cache);
+
+    std::vector<uint64_t> keys(100000);
+    std::iota(keys.begin(), keys.end(), 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+    for (auto key : keys) {
+        ASSERT_TRUE(tree.insert(key, key * 2));
+    }
+    ASSERT_GE(tree.height(), 3);
+
+    uint64_t expected = 100;
+    for (auto it = tree.lower_bound(100); it != tree.end(); ++it) {
+        ASSERT_EQ(it.key(), expected);
+        ASSERT_EQ(it.value(), expected * 2);
+        expected++;
+    }
+    ASSERT_EQ(expected, 100000);
+}
+
+TEST(MemoryTest, rainman_cache_10) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    auto hot = rainman::virtual_array<uint64_t>(cache, 512);
+    auto cold = rainman::virtual_array<uint64_t>(cache, 65536);
+
+    for (uint64_t i = 0; i < 65536; i++) {
+        cold.set(i, i);
+    }
+
+    ASSERT_EQ(cold.stats().misses, 128);
+    ASSERT_EQ(cache.stats().misses, 128);
+    cache.reset_stats();
+
+    for (uint64_t i = 0; i < 512; i++) {
+        hot.set(i, i);
+    }
+
+    for (uint64_t i = 0; i < 512; i++) {
+        ASSERT_EQ(hot[i], i);
+    }
+
+    // Each of the hot array's pages misses once and stays resident, evicting pages of the cold array.
+    auto hot_stats = hot.stats();
+    ASSERT_EQ(hot_stats.misses, 1);
+    ASSERT_EQ(hot_stats.hits, 1023);
+    ASSERT_EQ(hot_stats.evictions, 1);
+    ASSERT_EQ(hot_stats.bytes_read, 0x1000);
+
+    auto stats = cache.stats();
+    ASSERT_EQ(stats.misses, 1);
+    ASSERT_EQ(stats.write_backs, 1);
+    ASSERT_EQ(stats.bytes_written, 0x1000);
+    ASSERT_EQ(stats.resident_pages, 4);
+    ASSERT_EQ(stats.file_size, 0x1000 + 65536 * sizeof(uint64_t));
+    ASSERT_EQ(cold.stats().misses, 0);
+
+    // Scanning the cold array again misses on every page.
+    for (uint64_t i = 0; i < 65536; i++) {
+        ASSERT_EQ(cold[i], i);
+    }
+
+    ASSERT_EQ(cold.stats().misses, 128);
+    ASSERT_LT(cache.stats().hit_rate(), 1.0);
+
+    // Resetting an array keeps its counts in the cache's totals.
+    cold.reset_stats();
+    ASSERT_EQ(cold.stats().misses, 0);
+    ASSERT_EQ(cache.stats().misses, 129);
+
+    // Freeing an allocation in the middle of the file shows up as fragmentation.
+    auto gap = cache.allocate<uint64_t>(512);
+    auto tail = cache.allocate<uint64_t>(512);
+    cache.deallocate(gap);
+
+    stats = cache.stats();
+    ASSERT_EQ(stats.free_regions, 1);
+    ASSERT_EQ(stats.free_bytes, 0x1000);
+    ASSERT_GT(stats.fragmentation(), 0.0);
+
+    cache.deallocate(tail);
+    ASSERT_EQ(cache.stats().free_regions, 0);
+}
+
+TEST(MemoryTest, rainman_buffer_pool_1) {
+    auto allocator = rainman::Allocator().create_child();
+    auto pool = rainman::buffer_pool(0x10000, allocator);
+
+    auto cache_a = rainman::cache("cache_a.rain", 0x1000, rainman::cache_options{.pool=pool});
+    auto a = rainman::virtual_array<uint32_t>(cache_a, 65536);
+
+    // A single cache may use the whole budget.
+    for (uint32_t i = 0; i < 65536; i++) {
+        a.set(i, i);
+    }
+
+    ASSERT_EQ(pool.stats().used, 0x10000);
+    ASSERT_EQ(cache_a.stats().resident_pages, 16);
+    ASSERT_GE(allocator.alloc_size(), 0x10000 + 16 * sizeof(rainman::page_frame));
+
+    // Another cache takes frames from the first until both hold their fair share.
+    {
+        auto cache_b = rainman::cache("cache_b.rain", 0x1000, rainman::cache_options{.pool=pool});
+        auto b = rainman::virtual_array<uint32_t>(cache_b, 65536);
+
+        for (uint32_t i = 0; i < 65536; i++) {
+            b.set(i * 3, i);
+        }
+
+        ASSERT_EQ(pool.stats().caches, 2);
+        ASSERT_EQ(pool.stats().used, 0x10000);
+        ASSERT_EQ(pool.stats().reclaimed, 8);
+        ASSERT_EQ(cache_a.stats().resident_pages, 8);
+        ASSERT_EQ(cache_b.stats().resident_pages, 8);
+
+        for (uint32_t i = 0; i < 65536; i++) {
+            ASSERT_EQ(a[i], i);
+            ASSERT_EQ(b[i], i * 3);
+        }
+    }
+
+    // The frames of a destroyed cache go back to the pool.
+    ASSERT_EQ(pool.stats().caches, 1);
+    ASSERT_EQ(pool.stats().used, 0x8000);
+
+    for (uint32_t i = 0; i < 65536; i++) {
+        ASSERT_EQ(a[i], i);
+    }
+
+    ASSERT_EQ(pool.stats().used, 0x10000);
+}
+
+TEST(MemoryTest, rainman_buffer_pool_2) {
+    auto pool = rainman::buffer_pool(0x10000);
+
+    {
+        std::ofstream garbage("cache_a.rain", std::ios::binary);
+        garbage << std::string(0x2000, 'x');
+    }
+
+    // Opening fails after the cache joined the pool and took a frame to read the header; both are given back.
+    ASSERT_THROW(rainman::cache("cache_a.rain", 0x1000, rainman::cache_options{.persistent=true, .pool=pool}),
+                 MemoryErrors::IOException);
+    ASSERT_EQ(pool.stats().caches, 0);
+    ASSERT_EQ(pool.stats().used, 0);
+
+    auto cache = rainman::cache("cache_b.rain", 0x1000, rainman::cache_options{.pool=pool});
+    auto arr = rainman::virtual_array<uint32_t>(cache, 65536);
+    for (uint32_t i = 0; i < 65536; i++) {
+        arr.set(i, i);
+    }
+    ASSERT_EQ(pool.stats().caches, 1);
+    ASSERT_EQ(pool.stats().used, 0x10000);
+    remove("cache_a.rain");
+}
+
+TEST(MemoryTest, rainman_cache_11) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=16, .dirty_ratio=0.5});
+    auto arr = rainman::virtual_array<uint32_t>(cache, 262144);
+
+    for (uint32_t i = 0; i < 262144; i++) {
+        arr.set(i, i);
+    }
+
+    // The background writer keeps at most half of the frames dirty, so only part of the pages are left to flush.
+    cache.flush();
+    ASSERT_EQ(cache.stats().write_backs, 256);
+
+    for (uint32_t i = 0; i < 262144; i++) {
+        ASSERT_EQ(arr[i], i);
+    }
+}
+
+TEST(MemoryTest, rainman_storage_1) {
+    auto fp = fopen("storage.rain", "wb+");
+    auto storage = rainman::stdio_storage(fp, 0x1000);
+
+    std::vector<std::vector<uint8_t>> data(8, std::vector<uint8_t>(0x1000));
+    std::vector<const uint8_t *> pages;
+    for (uint64_t i = 0; i < 8; i++) {
+        std::fill(data[i].begin(), data[i].end(), (uint8_t) (i + 1));
+        pages.push_back(data[i].data());
+    }
+
+    storage.write_pages(2, pages.data(), 8);
+
+    std::vector<uint8_t> page(0x1000);
+    for (uint64_t i = 0; i < 12; i++) {
+        storage.read_page(i, page.data());
+        auto expected = (uint8_t) (i >= 2 && i < 10 ? i - 1 : 0);
+        ASSERT_EQ(page[0], expected);
+        ASSERT_EQ(page[0xfff], expected);
+    }
+}
+
+TEST(MemoryTest, rainman_cache_12) {
+    // Direct I/O needs whole file system blocks.
+    ASSERT_THROW(rainman::cache("cache.rain", 1000, rainman::cache_options{.backend=rainman::cache_backend::direct}),
+                 MemoryErrors::InvalidOperationException);
+
+    auto cache = rainman::cache("cache.rain", 0x10000,
+                                rainman::cache_options{.backend=rainman::cache_backend::direct, .frames=4,
+                                        .dirty_ratio=0.5});
+    auto arr = rainman::virtual_array<uint64_t>(cache, 1048576);
+
+    for (uint64_t i = 0; i < 1048576; i++) {
+        arr.set(i * 5, i);
+    }
+
+    // A write that does not start at a block boundary.
+    arr.set(7, 3);
+
+    cache.flush();
+
+    for (uint64_t i = 0; i < 1048576; i++) {
+        ASSERT_EQ(arr[i], i == 3 ? 7 : i * 5);
+    }
+}
+
+TEST(MemoryTest, rainman_cache_13) {
+    auto cache = rainman::cache("cache.rain", 0x1000, rainman::cache_options{.frames=4});
+    std::optional<rainman::virtual_array<uint32_t>> first(std::in_place, cache, 100000);
+    std::optional<rainman::virtual_array<uint32_t>> second(std::in_place, cache, 100000);
+    auto arr = rainman::virtual_array<uint32_t>(cache, 100000);
+
+    for (uint32_t i = 0; i < 100000; i++) {
+        arr.set(i * 3, i);
+        first->set(i, i);
+    }
+
+    // The first two arrays leave a hole before the last one. Its whole pages are given back right away.
+    first.reset();
+    second.reset();
+
+    auto stats = cache.stats();
+    ASSERT_EQ(stats.free_bytes, 800000);
+    ASSERT_GT(stats.bytes_reclaimed, 790000);
+    ASSERT_LE(stats.bytes_reclaimed, 800000);
+
+    uint64_t calls = 0;
+    auto result = cache.compact([&calls](const rainman::compaction_stats &/* progress */) { calls++; });
+    ASSERT_EQ(calls, 1);
+    ASSERT_EQ(result.allocations_moved, 1);
+    ASSERT_EQ(result.bytes_moved, 400000);
+    ASSERT_EQ(result.file_size_before, 1200000);
+    ASSERT_EQ(result.file_size_after, 400000);
+    ASSERT_EQ(arr.index(), 0);
+    ASSERT_EQ(cache.stats().free_bytes, 0);
+
+    cache.flush();
+    // Runs of dirty pages are written back as whole pages.
+    ASSERT_LE(std::filesystem::file_size("cache.rain"), 400000 + 0x1000);
+
+    for (uint32_t i = 0; i < 100000; i++) {
+        ASSERT_EQ(arr[i], i * 3);
+    }
+}
+
+TEST(MemoryTest, rainman_cache_14) {
+    {
+        auto cache = rainman::cache("cache.rain", 0x1000,
+                                    rainman::cache_options{.frames=8, .read_ahead=6, .dirty_ratio=0.5,
+                                            .stripes={"stripe1.rain", "stripe2.rain"}});
+        auto arr = rainman::virtual_array<uint32_t>(cache, 300000);
+
+        for (uint32_t i = 0; i < 300000; i++) {
+            arr.set(i ^ 0x5a5a, i);
+        }
+
+        cache.flush();
+
+        // 1200000 bytes span 293 pages, which are dealt out to the files 98, 98 and 97 at a time. The last page,
+        // in the second file, is only partly used.
+        ASSERT_EQ(std::filesystem::file_size("cache.rain"), 98 * 0x1000);
+        ASSERT_GE(std::filesystem::file_size("stripe1.rain"), 1200000 - 195 * 0x1000);
+        ASSERT_LE(std::filesystem::file_size("stripe1.rain"), 98 * 0x1000);
+        ASSERT_EQ(std::filesystem::file_size("stripe2.rain"), 97 * 0x1000);
+
+        for (uint32_t i = 0; i < 300000; i++) {
+            ASSERT_EQ(arr[i], i ^ 0x5a5a);
+        }
+    }
+
+    std::remove("stripe1.rain");
+    std::remove("stripe2.rain");
+}
+
+TEST(MemoryTest, rainman_codec_1) {
+    auto codec = rainman::lz_codec();
+
+    std::vector<uint8_t> src(100000), packed(100000), unpacked(100000);
+    uint32_t state = 1;
+    for (int i = 0; i < 100000; i++) {
+        state = state * 1103515245 + 12345;
+        src[i] = i % 1000 < 500 ? (uint8_t) (state >> 24) : (uint8_t) (i % 7);
+    }
+
+    auto length = codec.compress(src.data(), src.size(), packed.data(), packed.size());
+    ASSERT_GT(length, 0);
+    ASSERT_LT(length, src.size());
+    ASSERT_TRUE(codec.decompress(packed.data(), length, unpacked.data(), unpacked.size()));
+    ASSERT_EQ(src, unpacked);
+
+    // Random data does not fit in a smaller buffer, and corrupt input is rejected.
+    for (auto &byte : src) {
+        state = state * 1103515245 + 12345;
+        byte = state >> 24;
+    }
+    ASSERT_EQ(codec.compress(src.data(), src.size(), packed.data(), 1000), 0);
+    ASSERT_FALSE(codec.decompress(packed.data(), 1000, unpacked.data(), unpacked.size()));
+}
+
 TEST(MemoryTest, rainman_pointer_1) {
     auto p = rainman::ptr<int>(20);
 